@@ -0,0 +1,261 @@
+#include "bdpt.h"
+#include <cmath>
+
+// Samples the next direction of a sub-path at the vertex the ray r hit and
+// updates beta. Returns false if the sub-path ends there.
+bool extend_subpath(Scene& s, Ray& r, const PathVertex& v, Intersection inter, glm::vec3& beta, Sampler& sampler, int dim) {
+    const float eps = 1e-4;
+    if (!v.delta) {
+        if (v.is_inside) {
+            return false;
+        }
+        glm::vec2 u = sampler.get_2d(dim + DIM_BSDF_DIRECTION);
+        glm::vec3 d = sample_cosine_hemisphere(v.norm, u.x, u.y);
+        float pdf = s.dist.cosine.pdf(v.point, v.norm, d);
+        if (pdf <= 0) {
+            return false;
+        }
+        beta *= s.objects[v.obj_id].color / 3.14f * glm::dot(v.norm, d) / pdf;
+        r = Ray(v.point + v.norm * eps, d);
+        return true;
+    }
+    float bsdf_pdf;
+    return scatter(s, v.obj_id, r, inter, beta, sampler, dim, bsdf_pdf);
+}
+
+PathVertex make_vertex(Scene& s, Ray r, int obj_id, Intersection inter, glm::vec3 beta) {
+    PathVertex v;
+    v.point = r.start + r.direction * inter.t;
+    v.norm = inter.norm;
+    v.obj_id = obj_id;
+    v.is_inside = inter.is_inside;
+    v.delta = s.objects[obj_id].material != Material::Diffuse;
+    v.beta = beta;
+    v.emission = emitted(s.objects[obj_id], inter);
+    return v;
+}
+
+// Camera vertex followed by at most recursion_depth surface vertices, the
+// same vertices a path traced by trace_path() would visit. Returns the
+// background seen if the sub-path leaves the scene.
+glm::vec3 camera_subpath(Ray r, Scene& s, Sampler& sampler, std::vector<PathVertex>& path) {
+    PathVertex camera;
+    camera.point = r.start;
+    camera.norm = r.direction;
+    camera.obj_id = -1;
+    camera.is_inside = false;
+    camera.delta = false;
+    camera.beta = glm::vec3(1.0);
+    camera.emission = glm::vec3(0.0);
+    path.push_back(camera);
+    glm::vec3 beta(1.0);
+    for (int depth = 0; depth < s.recursion_depth; ++depth) {
+        std::optional<std::pair<int, Intersection>> hit = closest_intersection(r, s);
+        if (!hit.has_value()) {
+            return beta * s.bg_color;
+        }
+        auto [obj_id, inter] = hit.value();
+        path.push_back(make_vertex(s, r, obj_id, inter, beta));
+        if (!extend_subpath(s, r, path.back(), inter, beta, sampler, bounce_dimension(depth))) {
+            break;
+        }
+    }
+    return glm::vec3(0.0);
+}
+
+// Point on a light chosen by power followed by surface vertices. A full path
+// has at most recursion_depth + 1 vertices and at least two of them on the
+// camera sub-path, which leaves recursion_depth - 1 for the light sub-path.
+// Its dimensions follow those of the camera sub-path.
+void light_subpath(Scene& s, Sampler& sampler, std::vector<PathVertex>& path) {
+    const float eps = 1e-4;
+    int max_vertices = s.recursion_depth - 1;
+    if (s.dist.lights.empty() || max_vertices < 1) {
+        return;
+    }
+    int dim = bounce_dimension(s.recursion_depth);
+    float u_face;
+    int light_id = s.dist.light_table.sample(sampler.get_1d(dim + DIM_LIGHT_SELECT), u_face);
+    LightDistribution& light = s.dist.lights[light_id];
+    PathVertex origin;
+    float area_pdf;
+    origin.point = light.sample_surface(u_face, sampler.get_2d(dim + DIM_LIGHT_POSITION), origin.norm, area_pdf);
+    origin.obj_id = light.obj_id;
+    origin.is_inside = false;
+    origin.delta = false;
+    origin.emission = s.objects[light.obj_id].emission;
+    origin.beta = origin.emission / (area_pdf * s.dist.light_table.pmf[light_id]);
+    path.push_back(origin);
+
+    glm::vec2 u = sampler.get_2d(dim + DIM_BSDF_DIRECTION);
+    glm::vec3 d = sample_cosine_hemisphere(origin.norm, u.x, u.y);
+    float pdf = s.dist.cosine.pdf(origin.point, origin.norm, d);
+    if (pdf <= 0) {
+        return;
+    }
+    glm::vec3 beta = origin.beta * glm::dot(origin.norm, d) / pdf;
+    Ray r(origin.point + origin.norm * eps, d);
+    for (int depth = 1; depth < max_vertices; ++depth) {
+        std::optional<std::pair<int, Intersection>> hit = closest_intersection(r, s);
+        if (!hit.has_value()) {
+            return;
+        }
+        auto [obj_id, inter] = hit.value();
+        path.push_back(make_vertex(s, r, obj_id, inter, beta));
+        if (depth + 1 == max_vertices) {
+            return;
+        }
+        if (!extend_subpath(s, r, path.back(), inter, beta, sampler, bounce_dimension(s.recursion_depth + depth))) {
+            return;
+        }
+    }
+}
+
+// Density with respect to area of sampling to from the diffuse or light
+// vertex from. Directions leaving a specular vertex are not sampled from a
+// density, their vertices count with density 1 so that the strategies
+// sampling and not sampling them compare by the other vertices only.
+double vertex_pdf(Scene& s, const PathVertex& from, const PathVertex& to) {
+    if (from.delta) {
+        return 1;
+    }
+    glm::vec3 d = to.point - from.point;
+    float distance2 = glm::dot(d, d);
+    d /= std::sqrt(distance2);
+    return s.dist.cosine.pdf(from.point, from.norm, d) * std::abs(glm::dot(to.norm, d)) / distance2;
+}
+
+// Power heuristic weight of the strategy taking the first strategy vertices
+// of path from the light sub-path. The path runs from the light to the
+// camera. The densities of all strategies are compared as products over the
+// vertices, so that the one light vertex strategy, which samples the light
+// from the receiver, can use its own density.
+float mis_weight(Scene& s, const std::vector<const PathVertex*>& path, int strategy) {
+    int k = path.size() - 1;
+    int light_id = s.dist.light_index(path[0]->obj_id);
+    if (light_id < 0) {
+        // Only camera sub-paths reach emitters that are not sampled as lights.
+        return strategy == 0 ? 1 : 0;
+    }
+    const PathVertex& light_point = *path[0];
+    const PathVertex& receiver = *path[1];
+    std::vector<double> from_light(k, 1);
+    std::vector<double> from_camera(k, 1);
+    from_light[0] = s.dist.light_table.pmf[light_id] * s.dist.lights[light_id].surface_pdf(light_point.point);
+    for (int i = 1; i < k; ++i) {
+        from_light[i] = vertex_pdf(s, *path[i - 1], *path[i]);
+    }
+    // The vertex next to the camera is always sampled from it.
+    for (int i = 0; i + 1 < k; ++i) {
+        from_camera[i] = vertex_pdf(s, *path[i + 1], *path[i]);
+    }
+    double light_sample_pdf = 0;
+    if (k > 1 && !receiver.delta) {
+        glm::vec3 d = light_point.point - receiver.point;
+        float distance2 = glm::dot(d, d);
+        d /= std::sqrt(distance2);
+        light_sample_pdf = s.dist.light_pdf(receiver.point, receiver.norm, d, light_id) * std::abs(glm::dot(light_point.norm, d)) / distance2;
+    }
+    double own = 0;
+    double sum = 0;
+    for (int i = 0; i < k; ++i) {
+        if (i > 0 && (path[i - 1]->delta || path[i]->delta)) {
+            continue;
+        }
+        double p = 1;
+        for (int j = 0; j < i; ++j) {
+            p *= j == 0 && i == 1 ? light_sample_pdf : from_light[j];
+        }
+        for (int j = i; j < k; ++j) {
+            p *= from_camera[j];
+        }
+        sum += p * p;
+        if (i == strategy) {
+            own = p * p;
+        }
+    }
+    return sum > 0 ? own / sum : 0;
+}
+
+bool visible(Scene& s, glm::vec3 point, glm::vec3 norm, glm::vec3 target) {
+    const float eps = 1e-4;
+    glm::vec3 start = point + norm * eps;
+    glm::vec3 d = target - start;
+    float distance = glm::length(d);
+    std::optional<std::pair<int, Intersection>> hit = closest_intersection(Ray(start, d / distance), s);
+    return !hit.has_value() || hit.value().second.t >= distance - 2 * eps;
+}
+
+glm::vec3 bdpt_radiance(Ray r, Scene& s, Sampler& sampler, FirstHit* first_hit) {
+    const float eps = 1e-4;
+    std::vector<PathVertex> camera_path;
+    std::vector<PathVertex> light_path;
+    glm::vec3 col = camera_subpath(r, s, sampler, camera_path);
+    light_subpath(s, sampler, light_path);
+    if (first_hit && camera_path.size() > 1) {
+        const PathVertex& v = camera_path[1];
+        *first_hit = {v.obj_id, v.norm, glm::length(v.point - r.start)};
+    }
+
+    std::vector<const PathVertex*> path;
+    for (int t = 2; t <= camera_path.size(); ++t) {
+        const PathVertex& z = camera_path[t - 1];
+        auto add_camera_vertices = [&]() {
+            for (int i = t - 1; i >= 0; --i) {
+                path.push_back(&camera_path[i]);
+            }
+        };
+        if (z.emission != glm::vec3(0.0)) {
+            path.clear();
+            add_camera_vertices();
+            col += z.beta * z.emission * mis_weight(s, path, 0);
+        }
+        // Connections add at least one vertex to the camera sub-path.
+        if (z.delta || z.is_inside || t > s.recursion_depth) {
+            continue;
+        }
+        glm::vec3 f_z = s.objects[z.obj_id].color / 3.14f;
+
+        int light_id;
+        int dim = bounce_dimension(t - 2);
+        glm::vec3 d = s.dist.sample_light(z.point, z.norm, sampler, dim, light_id);
+        float cosine = glm::dot(z.norm, d);
+        if (light_id >= 0 && cosine > 0) {
+            Ray shadow(z.point + z.norm * eps, d);
+            std::optional<std::pair<int, Intersection>> hit = closest_intersection(shadow, s);
+            float light_pdf = s.dist.light_pdf(z.point, z.norm, d, light_id);
+            if (hit.has_value() && hit.value().first == s.dist.lights[light_id].obj_id && light_pdf > 0) {
+                PathVertex light_point = make_vertex(s, shadow, hit.value().first, hit.value().second, glm::vec3(1.0));
+                if (light_point.emission != glm::vec3(0.0)) {
+                    path.clear();
+                    path.push_back(&light_point);
+                    add_camera_vertices();
+                    col += z.beta * f_z * light_point.emission * cosine / light_pdf * mis_weight(s, path, 1);
+                }
+            }
+        }
+
+        for (int s_count = 2; s_count <= light_path.size() && s_count + t <= s.recursion_depth + 1; ++s_count) {
+            const PathVertex& y = light_path[s_count - 1];
+            if (y.delta || y.is_inside) {
+                continue;
+            }
+            glm::vec3 d = y.point - z.point;
+            float distance2 = glm::dot(d, d);
+            d /= std::sqrt(distance2);
+            float cos_z = glm::dot(z.norm, d);
+            float cos_y = -glm::dot(y.norm, d);
+            if (cos_z <= 0 || cos_y <= 0 || !visible(s, z.point, z.norm, y.point)) {
+                continue;
+            }
+            glm::vec3 f_y = s.objects[y.obj_id].color / 3.14f;
+            path.clear();
+            for (int i = 0; i < s_count; ++i) {
+                path.push_back(&light_path[i]);
+            }
+            add_camera_vertices();
+            col += y.beta * f_y * (cos_y * cos_z / distance2) * f_z * z.beta * mis_weight(s, path, s_count);
+        }
+    }
+    return col;
+}
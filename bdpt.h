@@ -0,0 +1,31 @@
+#include <vector>
+#include <glm/vec3.hpp>
+#include "scene.h"
+
+#pragma once
+
+// Bidirectional path tracing (Veach 1997, "Robust Monte Carlo Methods for
+// Light Transport Simulation", chapter 10). A camera sub-path and a light
+// sub-path are traced independently and every pair of their prefixes is
+// joined into a full path, the strategies for a path being weighted with the
+// power heuristic. Diffuse vertices sample cosine-weighted directions on
+// both sub-paths so that every strategy's density can be evaluated at any
+// vertex. Paths made of one camera vertex (light tracing) are not used, they
+// would need splatting into other pixels, and the one light vertex
+// strategy samples the light from the receiver like next-event estimation.
+
+struct PathVertex {
+    glm::vec3 point;
+    // Faces the side the vertex is seen from.
+    glm::vec3 norm;
+    int obj_id;
+    bool is_inside;
+    // Specular or dielectric vertex, which cannot be connected to.
+    bool delta;
+    // Product of the sampling weights up to this vertex.
+    glm::vec3 beta;
+    // Light emitted towards the previous vertex of a camera sub-path.
+    glm::vec3 emission;
+};
+
+glm::vec3 bdpt_radiance(Ray r, Scene& s, Sampler& sampler, FirstHit* first_hit = nullptr);
@@ -0,0 +1,158 @@
+#include <iostream>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <glm/vec3.hpp>
+#include <glm/geometric.hpp>
+#include "random.h"
+#include "distribution.h"
+#include "tone_map.h"
+
+// Keeps the optimiser from dropping the sampled values.
+volatile float sink;
+
+// Each call of body may take several samples.
+template <typename Body>
+void report(std::string name, int n, Body body, int samples_per_call = 1) {
+    auto begin = std::chrono::steady_clock::now();
+    float acc = 0;
+    for (int i = 0; i < n; ++i) {
+        acc += body(i);
+    }
+    auto end = std::chrono::steady_clock::now();
+    sink = acc;
+    double seconds = std::chrono::duration<double>(end - begin).count();
+    std::cout << name << ": " << double(n) * samples_per_call / seconds / 1e6 << " M samples/s" << std::endl;
+}
+
+int main(int argc, char** argv) {
+    int n = 10000000;
+    if (argc > 1) {
+        n = std::stoi(argv[1]);
+    }
+    glm::vec3 norm = glm::normalize(glm::vec3(0.3, 0.8, -0.2));
+
+    std::minstd_rand old_g(42);
+    Pcg32 g(42);
+
+    report("uniform, minstd_rand + uniform_real_distribution<>", n, [&](int) {
+        std::uniform_real_distribution<> dist(0, 1);
+        return float(dist(old_g));
+    });
+    report("uniform, Pcg32::next_float", n, [&](int) {
+        return g.next_float();
+    });
+
+    report("cosine hemisphere, 3x normal_distribution<>", n, [&](int) {
+        std::normal_distribution<> dist(0, 1);
+        float x = dist(old_g);
+        float y = dist(old_g);
+        float z = dist(old_g);
+        glm::vec3 sphere_point = glm::normalize(glm::vec3(x, y, z));
+        return glm::normalize(sphere_point + norm).x;
+    });
+    report("cosine hemisphere, concentric disk", n, [&](int) {
+        float u1 = g.next_float();
+        float u2 = g.next_float();
+        return sample_cosine_hemisphere(norm, u1, u2).x;
+    });
+
+    report("uniform sphere, 3x normal_distribution<>", n, [&](int) {
+        std::normal_distribution<> dist(0, 1);
+        float x = dist(old_g);
+        float y = dist(old_g);
+        float z = dist(old_g);
+        return glm::normalize(glm::vec3(x, y, z)).x;
+    });
+    report("uniform sphere, direct warp", n, [&](int) {
+        float u1 = g.next_float();
+        float u2 = g.next_float();
+        return sample_uniform_sphere(u1, u2).x;
+    });
+
+    glm::vec3 point(0.3, 0, 0.2);
+    glm::vec3 up(0, 1, 0);
+    Object light_object;
+    light_object.position = glm::vec3(0, 1.5, 0);
+    light_object.rotation = glm::normalize(glm::quat(0.9, 0.2, 0.3, 0.1));
+    light_object.emission = glm::vec3(1);
+    std::pair<std::string, Shape> light_shapes[] = {
+        {"box", Box(glm::vec3(0.3, 0.1, 0.5))},
+        {"sphere", Ellips(glm::vec3(0.3, 0.3, 0.3))},
+        {"ellipsoid", Ellips(glm::vec3(0.3, 0.1, 0.5))},
+    };
+    for (auto& [name, shape] : light_shapes) {
+        light_object.shape = shape;
+        LightDistribution light(light_object, 0);
+        report("light sample, " + name, n / 10, [&](int) {
+            float u_face = g.next_float();
+            glm::vec2 u(g.next_float(), g.next_float());
+            return light.sample(point, up, u_face, u).x;
+        });
+        report("light pdf, " + name, n / 10, [&](int) {
+            glm::vec3 d = sample_cosine_hemisphere(up, g.next_float(), g.next_float());
+            return light.pdf(point, up, d);
+        });
+    }
+
+    for (int count : {8, 32, 1024}) {
+        Pcg32 scene_g(7);
+        MixDistribution mix{CosineDistribution()};
+        for (int i = 0; i < count; ++i) {
+            Object o;
+            glm::vec3 size(scene_g.uniform(0.02, 0.1), scene_g.uniform(0.02, 0.1), scene_g.uniform(0.02, 0.1));
+            if (i % 2 == 0) {
+                o.shape = Box(size);
+            }
+            else {
+                o.shape = Ellips(size);
+            }
+            o.position = glm::vec3(scene_g.uniform(-2, 2), scene_g.uniform(1, 3), scene_g.uniform(-2, 2));
+            o.emission = glm::vec3(scene_g.uniform(1, 10));
+            mix.add_light(LightDistribution(o, i));
+        }
+        for (LightSelection selection : {LightSelection::Power, LightSelection::Bvh}) {
+            mix.selection = selection;
+            mix.build_light_table();
+            std::string mode = selection == LightSelection::Power ? "power" : "bvh";
+            report("mixture pdf, " + std::to_string(count) + " lights, " + mode, n / 20, [&](int) {
+                glm::vec3 d = sample_cosine_hemisphere(up, g.next_float(), g.next_float());
+                return mix.pdf(point, up, d);
+            });
+        }
+    }
+
+    // The row conversion against convert_color, which it replaces, over
+    // components from far below to far above white.
+    const int row_width = 4096;
+    const int count = row_width * 3;
+    std::vector<float> components(count);
+    std::vector<Color> converted(row_width);
+    int worst = 0;
+    long long exact = 0;
+    long long checked = 0;
+    for (; checked < n; checked += count) {
+        for (float& component : components) {
+            component = std::exp2(g.uniform(-16, 8));
+        }
+        tone_map_row(reinterpret_cast<const glm::vec3*>(components.data()), converted.data(), row_width);
+        const unsigned char* bytes = reinterpret_cast<const unsigned char*>(converted.data());
+        for (int i = 0; i < count; ++i) {
+            int difference = std::abs(bytes[i] - convert_color(components[i]));
+            worst = std::max(worst, difference);
+            exact += difference == 0;
+        }
+    }
+    std::cout << "tone map, tone_map_row vs convert_color: " << 100.0 * exact / checked << "% exact, at most " << worst << " apart" << std::endl;
+    report("tone map, convert_color", n, [&](int i) {
+        return float(convert_color(components[i % count]));
+    });
+    report("tone map, tone_map_row", n / count, [&](int) {
+        tone_map_row(reinterpret_cast<const glm::vec3*>(components.data()), converted.data(), row_width);
+        return float(converted[0].r);
+    }, count);
+    return worst > 1 ? 1 : 0;
+}
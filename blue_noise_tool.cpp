@@ -0,0 +1,78 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <cstdint>
+#include "random.h"
+
+// Offline generator of the tiled rank tables used by BlueNoiseSampler
+// (Ahmed and Wonka 2020, "Screen-Space Blue-Noise Diffusion of Monte Carlo
+// Sampling Error via Hierarchical Ordering of Pixels"). Each layer is a
+// size x size tile in which every aligned 2^k x 2^k block of pixels owns a
+// contiguous, aligned range of ranks. The order of the four children is
+// shuffled at every node, which breaks up the regular Z-order structure.
+
+void fill_ranks(std::vector<uint16_t>& ranks, int size, int x0, int y0, int block, int base, Pcg32& g) {
+    if (block == 1) {
+        ranks[x0 + y0 * size] = base;
+        return;
+    }
+    int order[4] = {0, 1, 2, 3};
+    for (int i = 3; i > 0; --i) {
+        std::swap(order[i], order[g.next_uint() % (i + 1)]);
+    }
+    int half = block / 2;
+    for (int i = 0; i < 4; ++i) {
+        int cx = x0 + (i & 1) * half;
+        int cy = y0 + (i >> 1) * half;
+        fill_ranks(ranks, size, cx, cy, half, base + order[i] * half * half, g);
+    }
+}
+
+std::vector<uint16_t> hierarchical_ranks(int size, uint64_t seed) {
+    Pcg32 g(seed);
+    std::vector<uint16_t> ranks(size * size);
+    fill_ranks(ranks, size, 0, 0, size, 0, g);
+    return ranks;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        std::cerr << "Usage: blue_noise_tool <output header> [size] [layers]" << std::endl;
+        return -1;
+    }
+    std::string filename = argv[1];
+    int size = 64;
+    int layers = 8;
+    if (argc > 2) {
+        size = std::stoi(argv[2]);
+    }
+    if (argc > 3) {
+        layers = std::stoi(argv[3]);
+    }
+    if (size <= 0 || size > 256 || (size & (size - 1)) != 0) {
+        std::cerr << "Tile size must be a power of two up to 256" << std::endl;
+        return -1;
+    }
+
+    std::ofstream fout(filename);
+    fout << "// Generated by blue_noise_tool, do not edit.\n";
+    fout << "#include <cstdint>\n\n#pragma once\n\n";
+    fout << "const int BLUE_NOISE_SIZE = " << size << ";\n";
+    fout << "const int BLUE_NOISE_LAYERS = " << layers << ";\n\n";
+    fout << "const uint16_t BLUE_NOISE_RANKS[" << layers << "][" << size * size << "] = {\n";
+    for (int layer = 0; layer < layers; ++layer) {
+        std::vector<uint16_t> ranks = hierarchical_ranks(size, 1000 + layer);
+        fout << "    {";
+        for (int i = 0; i < size * size; ++i) {
+            if (i % 16 == 0) {
+                fout << "\n        ";
+            }
+            fout << ranks[i] << ", ";
+        }
+        fout << "\n    },\n";
+    }
+    fout << "};\n";
+    return 0;
+}
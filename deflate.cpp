@@ -0,0 +1,387 @@
+#include "deflate.h"
+#include <algorithm>
+#include <queue>
+#include <utility>
+
+const int DEFLATE_WINDOW = 32768;
+const int DEFLATE_MIN_MATCH = 3;
+const int DEFLATE_MAX_MATCH = 258;
+const int DEFLATE_HASH_BITS = 15;
+// Candidates tried per position before the longest match so far is taken.
+const int DEFLATE_MAX_CHAIN = 64;
+// Symbols per block, each block getting its own Huffman codes.
+const int DEFLATE_BLOCK_SYMBOLS = 1 << 16;
+const int DEFLATE_MAX_STORED = 65535;
+
+const int LENGTH_BASE[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+const int LENGTH_EXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+const int DISTANCE_BASE[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+const int DISTANCE_EXTRA[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+// Order in which the lengths of the code length code are written.
+const int CODE_LENGTH_ORDER[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Literal if distance is 0, else a match of length bytes.
+struct LzSymbol {
+    uint16_t length;
+    uint16_t distance;
+};
+
+// Writes values least significant bit first, as deflate packs them.
+struct BitWriter {
+    std::vector<unsigned char>& out;
+    uint64_t bits = 0;
+    int count = 0;
+
+    BitWriter(std::vector<unsigned char>& o) : out(o) {}
+
+    void put(uint32_t value, int n) {
+        bits |= uint64_t(value) << count;
+        count += n;
+        while (count >= 8) {
+            out.push_back(bits & 0xff);
+            bits >>= 8;
+            count -= 8;
+        }
+    }
+
+    void align() {
+        if (count > 0) {
+            put(0, 8 - count);
+        }
+    }
+};
+
+int length_code(int length) {
+    return std::upper_bound(LENGTH_BASE, LENGTH_BASE + 29, length) - LENGTH_BASE - 1;
+}
+
+int distance_code(int distance) {
+    return std::upper_bound(DISTANCE_BASE, DISTANCE_BASE + 30, distance) - DISTANCE_BASE - 1;
+}
+
+// Huffman code lengths of at most max_length bits. Frequencies are flattened
+// until the tree is shallow enough. A single used symbol gets a partner so
+// that the code is complete, which decoders require of some codes.
+std::vector<int> huffman_lengths(std::vector<int> frequencies, int max_length) {
+    int n = frequencies.size();
+    std::vector<int> lengths(n, 0);
+    std::vector<int> used;
+    for (int i = 0; i < n; ++i) {
+        if (frequencies[i] > 0) {
+            used.push_back(i);
+        }
+    }
+    if (used.empty()) {
+        return lengths;
+    }
+    if (used.size() == 1) {
+        lengths[used[0]] = 1;
+        lengths[used[0] == 0 ? 1 : 0] = 1;
+        return lengths;
+    }
+    while (true) {
+        // Leaves are nodes 0 to used.size() - 1, inner nodes follow.
+        std::vector<int> parent(2 * used.size() - 1, -1);
+        std::priority_queue<std::pair<long long, int>, std::vector<std::pair<long long, int>>, std::greater<>> queue;
+        for (int i = 0; i < used.size(); ++i) {
+            queue.push({frequencies[used[i]], i});
+        }
+        int next = used.size();
+        while (queue.size() > 1) {
+            auto [weight_a, a] = queue.top();
+            queue.pop();
+            auto [weight_b, b] = queue.top();
+            queue.pop();
+            parent[a] = next;
+            parent[b] = next;
+            queue.push({weight_a + weight_b, next++});
+        }
+        int longest = 0;
+        for (int i = 0; i < used.size(); ++i) {
+            int depth = 0;
+            for (int node = i; parent[node] >= 0; node = parent[node]) {
+                ++depth;
+            }
+            lengths[used[i]] = depth;
+            longest = std::max(longest, depth);
+        }
+        if (longest <= max_length) {
+            return lengths;
+        }
+        for (int i : used) {
+            frequencies[i] = frequencies[i] / 2 + 1;
+        }
+    }
+}
+
+// Canonical codes for the lengths, bit-reversed for writing.
+std::vector<uint32_t> canonical_codes(const std::vector<int>& lengths) {
+    int count[16] = {};
+    for (int length : lengths) {
+        count[length] += 1;
+    }
+    count[0] = 0;
+    uint32_t next_code[16] = {};
+    uint32_t code = 0;
+    for (int bits = 1; bits < 16; ++bits) {
+        code = (code + count[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+    std::vector<uint32_t> codes(lengths.size(), 0);
+    for (int i = 0; i < lengths.size(); ++i) {
+        int length = lengths[i];
+        if (length == 0) {
+            continue;
+        }
+        uint32_t c = next_code[length]++;
+        uint32_t reversed = 0;
+        for (int b = 0; b < length; ++b) {
+            reversed |= ((c >> b) & 1) << (length - 1 - b);
+        }
+        codes[i] = reversed;
+    }
+    return codes;
+}
+
+void write_stored(BitWriter& writer, const unsigned char* data, size_t size, bool last) {
+    do {
+        int chunk = std::min<size_t>(size, DEFLATE_MAX_STORED);
+        size -= chunk;
+        writer.put(last && size == 0 ? 1 : 0, 1);
+        writer.put(0, 2);
+        writer.align();
+        writer.put(chunk, 16);
+        writer.put(~chunk & 0xffff, 16);
+        writer.out.insert(writer.out.end(), data, data + chunk);
+        data += chunk;
+    } while (size > 0);
+}
+
+// Writes the symbols covering data as one dynamic Huffman block, or as
+// stored blocks if those are smaller.
+void write_block(BitWriter& writer, const std::vector<LzSymbol>& symbols, const unsigned char* data, size_t size, bool last) {
+    std::vector<int> literal_frequencies(286, 0);
+    std::vector<int> distance_frequencies(30, 0);
+    for (LzSymbol symbol : symbols) {
+        if (symbol.distance == 0) {
+            literal_frequencies[symbol.length] += 1;
+        }
+        else {
+            literal_frequencies[257 + length_code(symbol.length)] += 1;
+            distance_frequencies[distance_code(symbol.distance)] += 1;
+        }
+    }
+    literal_frequencies[256] = 1;
+    std::vector<int> literal_lengths = huffman_lengths(literal_frequencies, 15);
+    std::vector<int> distance_lengths = huffman_lengths(distance_frequencies, 15);
+    int literal_count = 286;
+    while (literal_count > 257 && literal_lengths[literal_count - 1] == 0) {
+        --literal_count;
+    }
+    int distance_count = 30;
+    while (distance_count > 1 && distance_lengths[distance_count - 1] == 0) {
+        --distance_count;
+    }
+
+    // Run-length code of the concatenated code lengths, as pairs of a code
+    // length symbol and the value of its extra bits.
+    std::vector<int> all_lengths(literal_lengths.begin(), literal_lengths.begin() + literal_count);
+    all_lengths.insert(all_lengths.end(), distance_lengths.begin(), distance_lengths.begin() + distance_count);
+    std::vector<std::pair<int, int>> runs;
+    for (int i = 0; i < all_lengths.size();) {
+        int length = all_lengths[i];
+        int run = 1;
+        while (i + run < all_lengths.size() && all_lengths[i + run] == length) {
+            ++run;
+        }
+        if (length == 0 && run >= 11) {
+            run = std::min(run, 138);
+            runs.push_back({18, run - 11});
+        }
+        else if (length == 0 && run >= 3) {
+            runs.push_back({17, run - 3});
+        }
+        else if (run >= 4) {
+            run = std::min(run, 7);
+            runs.push_back({length, 0});
+            runs.push_back({16, run - 4});
+        }
+        else {
+            run = 1;
+            runs.push_back({length, 0});
+        }
+        i += run;
+    }
+    std::vector<int> code_length_frequencies(19, 0);
+    for (auto [symbol, extra] : runs) {
+        code_length_frequencies[symbol] += 1;
+    }
+    std::vector<int> code_length_lengths = huffman_lengths(code_length_frequencies, 7);
+    int code_length_count = 19;
+    while (code_length_count > 4 && code_length_lengths[CODE_LENGTH_ORDER[code_length_count - 1]] == 0) {
+        --code_length_count;
+    }
+
+    const int run_extra[3] = {2, 3, 7};
+    size_t bits = 17 + 3 * code_length_count;
+    for (auto [symbol, extra] : runs) {
+        bits += code_length_lengths[symbol] + (symbol >= 16 ? run_extra[symbol - 16] : 0);
+    }
+    for (LzSymbol symbol : symbols) {
+        if (symbol.distance == 0) {
+            bits += literal_lengths[symbol.length];
+        }
+        else {
+            int l = length_code(symbol.length);
+            int d = distance_code(symbol.distance);
+            bits += literal_lengths[257 + l] + LENGTH_EXTRA[l] + distance_lengths[d] + DISTANCE_EXTRA[d];
+        }
+    }
+    bits += literal_lengths[256];
+    size_t stored_bits = 8 * (size + 5 * (size / DEFLATE_MAX_STORED + 1));
+    if (bits > stored_bits) {
+        write_stored(writer, data, size, last);
+        return;
+    }
+
+    std::vector<uint32_t> literal_codes = canonical_codes(literal_lengths);
+    std::vector<uint32_t> distance_codes = canonical_codes(distance_lengths);
+    std::vector<uint32_t> code_length_codes = canonical_codes(code_length_lengths);
+    writer.put(last ? 1 : 0, 1);
+    writer.put(2, 2);
+    writer.put(literal_count - 257, 5);
+    writer.put(distance_count - 1, 5);
+    writer.put(code_length_count - 4, 4);
+    for (int i = 0; i < code_length_count; ++i) {
+        writer.put(code_length_lengths[CODE_LENGTH_ORDER[i]], 3);
+    }
+    for (auto [symbol, extra] : runs) {
+        writer.put(code_length_codes[symbol], code_length_lengths[symbol]);
+        if (symbol >= 16) {
+            writer.put(extra, run_extra[symbol - 16]);
+        }
+    }
+    for (LzSymbol symbol : symbols) {
+        if (symbol.distance == 0) {
+            writer.put(literal_codes[symbol.length], literal_lengths[symbol.length]);
+            continue;
+        }
+        int l = length_code(symbol.length);
+        int d = distance_code(symbol.distance);
+        writer.put(literal_codes[257 + l], literal_lengths[257 + l]);
+        writer.put(symbol.length - LENGTH_BASE[l], LENGTH_EXTRA[l]);
+        writer.put(distance_codes[d], distance_lengths[d]);
+        writer.put(symbol.distance - DISTANCE_BASE[d], DISTANCE_EXTRA[d]);
+    }
+    writer.put(literal_codes[256], literal_lengths[256]);
+}
+
+void deflate_blocks(const unsigned char* data, size_t size, bool last, std::vector<unsigned char>& out) {
+    BitWriter writer(out);
+    std::vector<int> head(1 << DEFLATE_HASH_BITS, -1);
+    std::vector<int> previous(DEFLATE_WINDOW, -1);
+    auto hash = [&](size_t p) {
+        uint32_t key = data[p] << 16 | data[p + 1] << 8 | data[p + 2];
+        return (key * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+    };
+    auto insert = [&](size_t p) {
+        if (p + DEFLATE_MIN_MATCH <= size) {
+            uint32_t h = hash(p);
+            previous[p % DEFLATE_WINDOW] = head[h];
+            head[h] = p;
+        }
+    };
+    std::vector<LzSymbol> symbols;
+    symbols.reserve(DEFLATE_BLOCK_SYMBOLS);
+    size_t block_start = 0;
+    size_t i = 0;
+    while (i < size) {
+        int best_length = 0;
+        int best_distance = 0;
+        if (i + DEFLATE_MIN_MATCH <= size) {
+            int limit = std::min<size_t>(DEFLATE_MAX_MATCH, size - i);
+            int candidate = head[hash(i)];
+            for (int chain = 0; candidate >= 0 && i - candidate <= DEFLATE_WINDOW && chain < DEFLATE_MAX_CHAIN; ++chain) {
+                if (data[candidate + best_length] == data[i + best_length]) {
+                    int length = 0;
+                    while (length < limit && data[candidate + length] == data[i + length]) {
+                        ++length;
+                    }
+                    if (length > best_length) {
+                        best_length = length;
+                        best_distance = i - candidate;
+                        if (length == limit) {
+                            break;
+                        }
+                    }
+                }
+                candidate = previous[candidate % DEFLATE_WINDOW];
+            }
+        }
+        if (best_length >= DEFLATE_MIN_MATCH) {
+            symbols.push_back({uint16_t(best_length), uint16_t(best_distance)});
+            for (int k = 0; k < best_length; ++k) {
+                insert(i + k);
+            }
+            i += best_length;
+        }
+        else {
+            symbols.push_back({data[i], 0});
+            insert(i);
+            i += 1;
+        }
+        if (symbols.size() == DEFLATE_BLOCK_SYMBOLS && i < size) {
+            write_block(writer, symbols, data + block_start, i - block_start, false);
+            symbols.clear();
+            block_start = i;
+        }
+    }
+    write_block(writer, symbols, data + block_start, size - block_start, last);
+    if (!last) {
+        write_stored(writer, nullptr, 0, false);
+    }
+    writer.align();
+}
+
+uint32_t adler32(const unsigned char* data, size_t size, uint32_t adler) {
+    // Largest run of bytes whose sums cannot overflow 32 bits.
+    const size_t chunk = 5552;
+    uint32_t a = adler & 0xffff;
+    uint32_t b = adler >> 16;
+    while (size > 0) {
+        size_t n = std::min(size, chunk);
+        size -= n;
+        for (size_t i = 0; i < n; ++i) {
+            a += data[i];
+            b += a;
+        }
+        data += n;
+        a %= 65521;
+        b %= 65521;
+    }
+    return b << 16 | a;
+}
+
+uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size) {
+    const uint64_t base = 65521;
+    uint64_t n = second_size % base;
+    uint64_t a1 = first & 0xffff;
+    uint64_t b1 = first >> 16;
+    uint64_t a2 = second & 0xffff;
+    uint64_t b2 = second >> 16;
+    // The bytes of the second piece add a1 to a once and to b once per byte.
+    uint64_t a = (a1 + a2 + base - 1) % base;
+    uint64_t b = (b1 + b2 + n * a1 + base - n) % base;
+    return b << 16 | a;
+}
+
+std::vector<unsigned char> zlib_compress(const unsigned char* data, size_t size) {
+    // Deflate with a 32K window, default level.
+    std::vector<unsigned char> out = {0x78, 0x9c};
+    deflate_blocks(data, size, true, out);
+    uint32_t adler = adler32(data, size);
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back(adler >> shift & 0xff);
+    }
+    return out;
+}
@@ -0,0 +1,19 @@
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#pragma once
+
+// Deflate compression (RFC 1951) for the image writers: greedy LZ77 matching
+// over hash chains and a dynamic Huffman code per block, with stored blocks
+// for data that does not compress.
+
+// Appends data as raw deflate blocks to out. Unless last, the blocks end
+// with an empty stored block, so they end on a byte boundary and the blocks
+// of the next part of a stream can be appended to them.
+void deflate_blocks(const unsigned char* data, size_t size, bool last, std::vector<unsigned char>& out);
+uint32_t adler32(const unsigned char* data, size_t size, uint32_t adler = 1);
+// Adler-32 of two pieces of data joined, from the checksums of the pieces.
+uint32_t adler32_combine(uint32_t first, uint32_t second, size_t second_size);
+// zlib stream (RFC 1950) of data.
+std::vector<unsigned char> zlib_compress(const unsigned char* data, size_t size);
@@ -0,0 +1,261 @@
+#include "denoiser.h"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <functional>
+#include <thread>
+
+// Albedo channels darker than this are not divided out of the color.
+const float DENOISE_MIN_ALBEDO = 1e-3;
+// Luminance differences are measured in standard deviations of the noise of
+// the difference, depth differences relative to the depth per pixel of
+// distance.
+const float DENOISE_SIGMA_LUMINANCE = 6;
+const float DENOISE_SIGMA_DEPTH = 0.02;
+// The normal weight is the cosine to the power 2^DENOISE_NORMAL_SQUARINGS.
+const int DENOISE_NORMAL_SQUARINGS = 7;
+// B3 spline, the one-dimensional factor of the 5x5 kernel.
+const float DENOISE_KERNEL[5] = {1 / 16.f, 1 / 4.f, 3 / 8.f, 1 / 4.f, 1 / 16.f};
+
+// exp(x) for x <= 0 without a call into libm, so loops using it vectorize.
+// Adding 1.5 * 2^23 rounds y to the integer in the low mantissa bits.
+inline float fast_exp(float x) {
+    const float round = 12582912.f;
+    float y = std::max(x, -80.f) * 1.44269504f;
+    float shifted = y + round;
+    float f = y - (shifted - round);
+    int i = std::bit_cast<int>(shifted) - std::bit_cast<int>(round);
+    float p = 1 + f * (0.69314718f + f * (0.24022651f + f * (0.05550411f + f * (0.00961813f + f * 0.00133336f))));
+    return p * std::bit_cast<float>((i + 127) << 23);
+}
+
+// Color planes and the variance of their luminance.
+struct DenoisePlanes {
+    std::vector<float> color[3];
+    std::vector<float> variance;
+
+    DenoisePlanes(int n) {
+        for (int c = 0; c < 3; ++c) {
+            color[c].assign(n, 0);
+        }
+        variance.assign(n, 0);
+    }
+};
+
+// The planes read by a filter pass, offset to one row or to the neighbours
+// of one row.
+struct DenoiseInputs {
+    const float* luminance;
+    const float* depth;
+    const float* smoothed_variance;
+    const float* inv_depth;
+    const float* normal[3];
+    const float* color[3];
+    const float* variance;
+
+    DenoiseInputs row(int offset) const {
+        DenoiseInputs r = *this;
+        r.luminance += offset;
+        r.depth += offset;
+        r.smoothed_variance += offset;
+        r.inv_depth += offset;
+        for (int c = 0; c < 3; ++c) {
+            r.normal[c] += offset;
+            r.color[c] += offset;
+        }
+        r.variance += offset;
+        return r;
+    }
+};
+
+// Weights of the neighbours q of count pixels p, q being the planes shifted
+// by the offset of one tap.
+void tap_weights(const DenoiseInputs& p, const DenoiseInputs& q, int count, float kernel, float inv_distance, float* __restrict weights) {
+    for (int x = 0; x < count; ++x) {
+        // The noise of both pixels makes the weight symmetric: a bright
+        // sample is taken in by the neighbours it spreads to, not dropped.
+        float sigma = DENOISE_SIGMA_LUMINANCE * std::sqrt(p.smoothed_variance[x] + q.smoothed_variance[x]) + 1e-6f;
+        float luminance_distance = std::abs(p.luminance[x] - q.luminance[x]) / sigma;
+        float depth_distance = std::abs(p.depth[x] - q.depth[x]) * p.inv_depth[x] * inv_distance;
+        float cosine = std::max(p.normal[0][x] * q.normal[0][x] + p.normal[1][x] * q.normal[1][x] + p.normal[2][x] * q.normal[2][x], 0.f);
+        for (int k = 0; k < DENOISE_NORMAL_SQUARINGS; ++k) {
+            cosine *= cosine;
+        }
+        weights[x] = kernel * cosine * fast_exp(-(luminance_distance + depth_distance));
+    }
+}
+
+void add_weighted(int count, const float* __restrict weights, const float* __restrict values, float* __restrict sum) {
+    for (int x = 0; x < count; ++x) {
+        sum[x] += weights[x] * values[x];
+    }
+}
+
+void parallel_rows(int height, int threads, const std::function<void(int)>& filter_row) {
+    std::atomic<int> next_row = 0;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            for (int y = next_row++; y < height; y = next_row++) {
+                filter_row(y);
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+// Variance of the luminance over the 3x3 neighbourhood of every pixel, for
+// images whose samples did not give a variance per pixel.
+void spatial_variance(int width, int height, const std::vector<float>& luminance, std::vector<float>& variance) {
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            float sum = 0;
+            float sum2 = 0;
+            int count = 0;
+            for (int qy = std::max(y - 1, 0); qy <= std::min(y + 1, height - 1); ++qy) {
+                for (int qx = std::max(x - 1, 0); qx <= std::min(x + 1, width - 1); ++qx) {
+                    float l = luminance[qx + qy * width];
+                    sum += l;
+                    sum2 += l * l;
+                    count += 1;
+                }
+            }
+            float mean = sum / count;
+            variance[x + y * width] = std::max(sum2 / count - mean * mean, 0.f);
+        }
+    }
+}
+
+void denoise(Framebuffer& frame, int iterations, int threads) {
+    int width = frame.width;
+    int height = frame.height;
+    int n = width * height;
+    if (iterations <= 0 || n == 0) {
+        return;
+    }
+    DenoisePlanes current(n);
+    DenoisePlanes next(n);
+    std::vector<float> modulation[3];
+    std::vector<float> normal[3];
+    std::vector<float> luminance(n);
+    for (int c = 0; c < 3; ++c) {
+        modulation[c].resize(n);
+        normal[c].resize(n);
+    }
+    for (int p = 0; p < n; ++p) {
+        glm::vec3 norm = frame.normal[p];
+        float length = glm::length(norm);
+        if (length > 0) {
+            norm /= length;
+        }
+        glm::vec3 albedo = frame.albedo[p];
+        glm::vec3 color = frame.color[p];
+        for (int c = 0; c < 3; ++c) {
+            modulation[c][p] = albedo[c] > DENOISE_MIN_ALBEDO ? albedo[c] : 1;
+            current.color[c][p] = color[c] / modulation[c][p];
+            normal[c][p] = norm[c];
+        }
+        luminance[p] = 0.2126f * current.color[0][p] + 0.7152f * current.color[1][p] + 0.0722f * current.color[2][p];
+    }
+    if (frame.variance.size() == n) {
+        current.variance = frame.variance;
+    }
+    else {
+        spatial_variance(width, height, luminance, current.variance);
+    }
+
+    std::vector<float> smoothed_variance(n);
+    std::vector<float> inv_depth(n);
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        int step = 1 << iteration;
+        for (int p = 0; p < n; ++p) {
+            luminance[p] = 0.2126f * current.color[0][p] + 0.7152f * current.color[1][p] + 0.0722f * current.color[2][p];
+            inv_depth[p] = 1 / (DENOISE_SIGMA_DEPTH * step * frame.depth[p] + 1e-6f);
+        }
+        // The variance is blurred over 3x3 pixels before it scales the
+        // luminance weights, as a single pixel's estimate is itself noisy.
+        parallel_rows(height, threads, [&](int y) {
+            for (int x = 0; x < width; ++x) {
+                float sum = 0;
+                float weight_sum = 0;
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        int qx = std::clamp(x + dx, 0, width - 1);
+                        int qy = std::clamp(y + dy, 0, height - 1);
+                        float weight = DENOISE_KERNEL[2 + dx] * DENOISE_KERNEL[2 + dy];
+                        sum += weight * current.variance[qx + qy * width];
+                        weight_sum += weight;
+                    }
+                }
+                smoothed_variance[x + y * width] = sum / weight_sum;
+            }
+        });
+
+        DenoiseInputs planes = {luminance.data(), frame.depth.data(), smoothed_variance.data(), inv_depth.data(),
+                                {normal[0].data(), normal[1].data(), normal[2].data()},
+                                {current.color[0].data(), current.color[1].data(), current.color[2].data()}, current.variance.data()};
+        parallel_rows(height, threads, [&](int y) {
+            std::vector<float> weights(width);
+            std::vector<float> squared_weights(width);
+            std::vector<float> sum_weight(width, 0);
+            std::vector<float> sum_color[3];
+            std::vector<float> sum_variance(width, 0);
+            for (int c = 0; c < 3; ++c) {
+                sum_color[c].assign(width, 0);
+            }
+            int row = y * width;
+            for (int dy = -2; dy <= 2; ++dy) {
+                int qy = y + dy * step;
+                if (qy < 0 || qy >= height) {
+                    continue;
+                }
+                for (int dx = -2; dx <= 2; ++dx) {
+                    int offset = dx * step;
+                    int begin = std::max(0, -offset);
+                    int end = std::min(width, width - offset);
+                    float kernel = DENOISE_KERNEL[2 + dx] * DENOISE_KERNEL[2 + dy];
+                    float inv_distance = 1.f / std::max(std::max(std::abs(dx), std::abs(dy)), 1);
+                    int count = end - begin;
+                    DenoiseInputs q = planes.row(qy * width + offset + begin);
+                    tap_weights(planes.row(row + begin), q, count, kernel, inv_distance, weights.data());
+                    for (int x = 0; x < count; ++x) {
+                        sum_weight[begin + x] += weights[x];
+                        squared_weights[x] = weights[x] * weights[x];
+                    }
+                    for (int c = 0; c < 3; ++c) {
+                        add_weighted(count, weights.data(), q.color[c], sum_color[c].data() + begin);
+                    }
+                    add_weighted(count, squared_weights.data(), q.variance, sum_variance.data() + begin);
+                }
+            }
+            for (int x = 0; x < width; ++x) {
+                int p = row + x;
+                float weight = sum_weight[x];
+                // Pixels without a surface have no weight even for themselves.
+                if (weight <= 0) {
+                    for (int c = 0; c < 3; ++c) {
+                        next.color[c][p] = current.color[c][p];
+                    }
+                    next.variance[p] = current.variance[p];
+                    continue;
+                }
+                for (int c = 0; c < 3; ++c) {
+                    next.color[c][p] = sum_color[c][x] / weight;
+                }
+                next.variance[p] = sum_variance[x] / (weight * weight);
+            }
+        });
+        std::swap(current, next);
+    }
+
+    for (int p = 0; p < n; ++p) {
+        glm::vec3 color;
+        for (int c = 0; c < 3; ++c) {
+            color[c] = current.color[c][p] * modulation[c][p];
+        }
+        frame.color.set(p, color);
+    }
+}
@@ -0,0 +1,13 @@
+#include "structures.h"
+
+#pragma once
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010, "Edge-Avoiding
+// A-Trous Wavelet Transform for fast Global Illumination Filtering") with the
+// variance-guided luminance weights of SVGF (Schied et al. 2017,
+// "Spatiotemporal Variance-Guided Filtering"). The color is divided by the
+// first-hit albedo before filtering and multiplied back after, so texture and
+// material edges stay sharp; normals and depth stop the filter at geometric
+// edges. Rows are filtered on several threads, each row as plain loops over
+// structure-of-arrays planes that the compiler turns into vector code.
+void denoise(Framebuffer& frame, int iterations, int threads);
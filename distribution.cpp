@@ -1,165 +1,614 @@
+#include <algorithm>
+#include <cmath>
 #include <iostream>
 #include <variant>
 #include <optional>
+#include <numbers>
 #include <glm/gtx/quaternion.hpp>
 #include "structures.h"
 #include "distribution.h"
-#include "ray.h"
 
 
-Distribution::Distribution(int seed) {
-    g = std::minstd_rand(seed);
+glm::vec3 CosineDistribution::sample(glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim) {
+    glm::vec2 u = sampler.get_2d(dim + DIM_BSDF_DIRECTION);
+    return sample_cosine_hemisphere(norm, u.x, u.y);
 }
 
-CosineDistribution::CosineDistribution(int seed) : Distribution(seed) {}
+float CosineDistribution::pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d) {
+    return std::max(0.0, glm::dot(norm, d) / 3.14);
+}
+
+// Spherical rectangle sampling (Urena et al. 2013, "An Area-Preserving
+// Parametrization for Spherical Rectangles"). The rectangle is given by a
+// corner and two orthogonal edges, seen from the origin.
+struct SphericalRectangle {
+    glm::dvec3 x, y, z;
+    double x0, y0, z0, x1, y1;
+    double b0, b1, k;
+    double solid_angle;
+
+    SphericalRectangle(glm::dvec3 corner, glm::dvec3 ex, glm::dvec3 ey) {
+        double exl = glm::length(ex);
+        double eyl = glm::length(ey);
+        x = ex / exl;
+        y = ey / eyl;
+        z = glm::cross(x, y);
+        z0 = glm::dot(corner, z);
+        if (z0 > 0) {
+            z = -z;
+            z0 = -z0;
+        }
+        x0 = glm::dot(corner, x);
+        y0 = glm::dot(corner, y);
+        x1 = x0 + exl;
+        y1 = y0 + eyl;
+        glm::dvec3 v00(x0, y0, z0), v01(x0, y1, z0), v10(x1, y0, z0), v11(x1, y1, z0);
+        glm::dvec3 n0 = glm::normalize(glm::cross(v00, v10));
+        glm::dvec3 n1 = glm::normalize(glm::cross(v10, v11));
+        glm::dvec3 n2 = glm::normalize(glm::cross(v11, v01));
+        glm::dvec3 n3 = glm::normalize(glm::cross(v01, v00));
+        double g0 = std::acos(std::clamp(-glm::dot(n0, n1), -1.0, 1.0));
+        double g1 = std::acos(std::clamp(-glm::dot(n1, n2), -1.0, 1.0));
+        double g2 = std::acos(std::clamp(-glm::dot(n2, n3), -1.0, 1.0));
+        double g3 = std::acos(std::clamp(-glm::dot(n3, n0), -1.0, 1.0));
+        b0 = n0.z;
+        b1 = n2.z;
+        k = 2 * std::numbers::pi - g2 - g3;
+        solid_angle = std::max(g0 + g1 - k, 0.0);
+        if (z0 == 0) {
+            solid_angle = 0;
+        }
+    }
 
-glm::vec3 CosineDistribution::sample(glm::vec3 point, glm::vec3 norm) {
-    std::normal_distribution<> dist(0, 1);
-    float x = dist(g);
-    float y = dist(g);
-    float z = dist(g);
-    glm::vec3 sphere_point = glm::normalize(glm::vec3(x, y, z));
-    return glm::normalize(sphere_point + norm);
+    glm::vec3 sample(glm::vec2 u) {
+        double au = u.x * solid_angle + k;
+        double fu = (std::cos(au) * b0 - b1) / std::sin(au);
+        double cu = std::clamp((fu > 0 ? 1 : -1) / std::sqrt(fu * fu + b0 * b0), -1.0, 1.0);
+        double xu = std::clamp(-(cu * z0) / std::sqrt(std::max(1 - cu * cu, 1e-12)), x0, x1);
+        double d = std::sqrt(xu * xu + z0 * z0);
+        double h0 = y0 / std::sqrt(d * d + y0 * y0);
+        double h1 = y1 / std::sqrt(d * d + y1 * y1);
+        double hv = h0 + u.y * (h1 - h0);
+        double yv = hv * hv < 1 - 1e-12 ? (hv * d) / std::sqrt(1 - hv * hv) : y1;
+        return glm::normalize(glm::vec3(xu * x + yv * y + z0 * z));
+    }
+};
+
+// Ellipsoids this close to a sphere are sampled by the cone of their
+// bounding sphere; directions that miss the ellipsoid are simply wasted.
+const float SPHERE_CAP_MIN_RATIO = 0.9;
+
+LightDistribution::LightDistribution(const Object& obj, int obj_id) {
+    this->obj_id = obj_id;
+    position = obj.position;
+    rotation = obj.rotation;
+    inv_rotation = glm::inverse(obj.rotation);
+    if (const Box* bval = std::get_if<Box>(&obj.shape)) {
+        shape = LightShape::Box;
+        extent = bval->size;
+        area = 8 * (extent.x * extent.y + extent.x * extent.z + extent.y * extent.z);
+    }
+    else {
+        shape = LightShape::Ellips;
+        extent = std::get<Ellips>(obj.shape).radius;
+        // Knud Thomsen's approximation of the ellipsoid surface area.
+        const float p = 1.6075;
+        float ab = std::pow(extent.x * extent.y, p);
+        float ac = std::pow(extent.x * extent.z, p);
+        float bc = std::pow(extent.y * extent.z, p);
+        area = 4 * 3.14 * std::pow((ab + ac + bc) / 3, 1 / p);
+    }
+    inv_extent = 1.f / extent;
+    max_extent = std::max(extent.x, std::max(extent.y, extent.z));
+    float min_extent = std::min(extent.x, std::min(extent.y, extent.z));
+    near_spherical = shape == LightShape::Ellips && min_extent >= SPHERE_CAP_MIN_RATIO * max_extent;
+    luminance = 0.2126 * obj.emission.x + 0.7152 * obj.emission.y + 0.0722 * obj.emission.z;
 }
 
-float CosineDistribution::pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d) {
-    return std::max(0.0, glm::dot(norm, d) / 3.14);
+glm::vec3 LightDistribution::sample(glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim) {
+    float u_face = sampler.get_1d(dim + DIM_LIGHT_SELECT);
+    glm::vec2 u = sampler.get_2d(dim + DIM_LIGHT_POSITION);
+    return sample(point, norm, u_face, u);
 }
 
-LightDistribution::LightDistribution(int seed, Object obj) : Distribution(seed) {
-    this->obj = obj;
+glm::vec3 LightDistribution::sample(glm::vec3 point, glm::vec3 norm, float u_face, glm::vec2 u) {
+    if (shape == LightShape::Box) {
+        return box_sample(point, u_face, u);
+    }
+    if (uses_sphere_cap(point)) {
+        return sphere_cap_sample(point, u);
+    }
+    return ellips_sample(point, u);
 }
 
-glm::vec3 LightDistribution::sample(glm::vec3 point, glm::vec3 norm) {
-    
-    if (Box* bval = std::get_if<Box>(&obj.shape)) {
-        glm::vec3 size = bval->size;
-        return box_sample(point, norm, size);
+float LightDistribution::pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d) {
+    if (shape == LightShape::Box) {
+        return pdfBox(point, d);
     }
-    Ellips eval = std::get<Ellips>(obj.shape);
-    glm::vec3 radius = eval.radius;
-    return ellips_sample(point, norm, radius);
+    if (uses_sphere_cap(point)) {
+        return pdfSphereCap(point, d);
+    }
+    return pdfEllips(point, d);
 }
 
-glm::vec3 LightDistribution::box_sample(glm::vec3 point, glm::vec3 norm, glm::vec3 size) {
-    float w = size.x * size.y + size.x * size.z + size.y * size.z;
-    std::uniform_real_distribution<> dist(0, w);
-    float r = dist(g);
+// Visible faces of the box as spherical rectangles, in the box frame.
+int visible_faces(glm::vec3 local_point, glm::vec3 size, std::optional<SphericalRectangle>* faces) {
+    int count = 0;
+    for (int k = 0; k < 3; ++k) {
+        if (std::abs(local_point[k]) <= size[k]) {
+            continue;
+        }
+        int a = (k + 1) % 3;
+        int b = (k + 2) % 3;
+        glm::dvec3 corner = -glm::dvec3(size);
+        corner[k] = local_point[k] > 0 ? size[k] : -size[k];
+        glm::dvec3 ex(0.0), ey(0.0);
+        ex[a] = 2 * size[a];
+        ey[b] = 2 * size[b];
+        faces[count++] = SphericalRectangle(corner - glm::dvec3(local_point), ex, ey);
+    }
+    return count;
+}
 
-    std::uniform_real_distribution<> distBool(0, 1);
-    int sign = 1;
-    if (distBool(g) > 0.5) {
-        sign = -1;
+glm::vec3 LightDistribution::box_sample(glm::vec3 point, float u_face, glm::vec2 u) {
+    glm::vec3 local_point = inv_rotation * (point - position);
+    std::optional<SphericalRectangle> faces[3];
+    int count = visible_faces(local_point, extent, faces);
+    double total = 0;
+    for (int i = 0; i < count; ++i) {
+        total += faces[i]->solid_angle;
+    }
+    if (total <= 0) {
+        return glm::vec3(0.0);
+    }
+    // Faces seen from outside a convex box do not overlap, so choosing one
+    // by solid angle and sampling it uniformly is uniform over the box.
+    double r = u_face * total;
+    for (int i = 0; i < count; ++i) {
+        if (r < faces[i]->solid_angle || i == count - 1) {
+            return rotation * faces[i]->sample(u);
+        }
+        r -= faces[i]->solid_angle;
     }
+    return glm::vec3(0.0);
+}
 
-    std::uniform_real_distribution<> distCoord(-1, 1);
-    float x = size.x * distCoord(g);
-    float y = size.y * distCoord(g);
-    float z = size.z * distCoord(g);
-    if (r < size.x * size.y) {
-        z = size.z * sign;
+float LightDistribution::pdfBox(glm::vec3 point, glm::vec3 d) {
+    glm::vec3 local_point = inv_rotation * (point - position);
+    glm::vec3 local_d = inv_rotation * d;
+    glm::vec3 t1 = (-extent - local_point) / local_d;
+    glm::vec3 t2 = (extent - local_point) / local_d;
+    glm::vec3 t_near = glm::min(t1, t2);
+    glm::vec3 t_far = glm::max(t1, t2);
+    float t_enter = std::max(t_near.x, std::max(t_near.y, t_near.z));
+    float t_exit = std::min(t_far.x, std::min(t_far.y, t_far.z));
+    if (t_enter > t_exit || t_enter < 0) {
+        return 0;
     }
-    else if (r < (size.x * size.y + size.x * size.z)) {
-        y = size.y * sign;
+    std::optional<SphericalRectangle> faces[3];
+    int count = visible_faces(local_point, extent, faces);
+    double total = 0;
+    for (int i = 0; i < count; ++i) {
+        total += faces[i]->solid_angle;
     }
-    else {
-        x = size.x * sign;
+    if (total <= 0) {
+        return 0;
     }
-    glm::vec3 objPoint = glm::vec3(x, y, z);
-    objPoint = obj.rotation * objPoint;
-    objPoint += obj.position;
-    return glm::normalize(objPoint - point);
+    return 1 / total;
+}
+
+bool LightDistribution::uses_sphere_cap(glm::vec3 point) {
+    if (!near_spherical) {
+        return false;
+    }
+    glm::vec3 to_center = point - position;
+    return glm::dot(to_center, to_center) > max_extent * max_extent * 1.0002f;
+}
+
+glm::vec3 LightDistribution::sphere_cap_sample(glm::vec3 point, glm::vec2 u) {
+    glm::vec3 to_center = position - point;
+    float dist = glm::length(to_center);
+    float sin2_max = max_extent * max_extent / (dist * dist);
+    float cos_max = std::sqrt(std::max(0.f, 1 - sin2_max));
+    // 1 - cos_max without cancellation for distant lights.
+    float one_minus_cos_max = sin2_max / (1 + cos_max);
+    float one_minus_cos = u.x * one_minus_cos_max;
+    float cos_theta = 1 - one_minus_cos;
+    float sin_theta = std::sqrt(std::max(0.f, one_minus_cos * (2 - one_minus_cos)));
+    float phi = 2 * PI * u.y;
+    glm::vec3 w = to_center / dist;
+    glm::vec3 t, b;
+    orthonormal_basis(w, t, b);
+    return glm::normalize(sin_theta * std::cos(phi) * t + sin_theta * std::sin(phi) * b + cos_theta * w);
 }
 
-glm::vec3 LightDistribution::ellips_sample(glm::vec3 point, glm::vec3 norm, glm::vec3 radius) {
-    std::normal_distribution<> dist(0, 1);
-    float x = dist(g);
-    float y = dist(g);
-    float z = dist(g);
-    glm::vec3 sphere_point = glm::normalize(glm::vec3(x, y, z));
-    glm::vec3 objPoint = sphere_point * radius;
-    objPoint = obj.rotation * objPoint;
-    objPoint += obj.position;
+float LightDistribution::pdfSphereCap(glm::vec3 point, glm::vec3 d) {
+    glm::vec3 to_center = position - point;
+    float dist = glm::length(to_center);
+    float sin2_max = max_extent * max_extent / (dist * dist);
+    float cos_max = std::sqrt(std::max(0.f, 1 - sin2_max));
+    if (glm::dot(d, to_center / dist) < cos_max) {
+        return 0;
+    }
+    return 1 / (2 * PI * sin2_max / (1 + cos_max));
+}
+
+glm::vec3 LightDistribution::ellips_sample(glm::vec3 point, glm::vec2 u) {
+    glm::vec3 sphere_point = sample_uniform_sphere(u.x, u.y);
+    glm::vec3 objPoint = rotation * (sphere_point * extent) + position;
     return glm::normalize(objPoint - point);
 }
 
-float LightDistribution::pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d) {
-    const float eps = 1e-4;
-    Ray r = Ray(point + norm * eps, d);
-    std::optional<Intersection> raw_inter = intersection(r, obj);
-    if (!raw_inter.has_value()) {
+float LightDistribution::pdfEllips(glm::vec3 point, glm::vec3 d) {
+    glm::vec3 local_d = inv_rotation * d;
+    glm::vec3 o = inv_rotation * (point - position) * inv_extent;
+    glm::vec3 dir = local_d * inv_extent;
+    float a = glm::dot(dir, dir);
+    float b2 = glm::dot(o, dir);
+    // b2^2 - a c computed from the closest approach to the center, which
+    // does not cancel catastrophically for distant lights.
+    glm::vec3 closest = o - dir * (b2 / a);
+    float disc = a * (1 - glm::dot(closest, closest));
+    if (disc < 0) {
         return 0;
     }
+    float sq = std::sqrt(disc);
     float p = 0;
-    Intersection inter = raw_inter.value();
-    bool isBox = false;
-    if (Box* bval = std::get_if<Box>(&obj.shape)) {
-        isBox = true;
-    }
-    Ray r2 = Ray(point + d * inter.t + norm * eps - inter.norm * eps, d);
-    std::optional<Intersection> raw_inter2 = intersection(r2, obj);
-    float mult1 = inter.t * inter.t / std::abs(glm::dot(d, inter.norm));
-    float mult2 = 0;
-    if (raw_inter2.has_value()) {
-        Intersection inter2 = raw_inter2.value();
-        mult2 = (inter2.t * inter2.t) / std::abs(glm::dot(d, inter2.norm));
-    }
-    if (isBox) {
-        p += pdfBox() * mult1;
-        p += pdfBox() * mult2;
-    }
-    else {
-        p += pdfEllips(inter.norm) * mult1;
-        if (raw_inter2.has_value()) {
-            Intersection inter2 = raw_inter2.value();
-            p += pdfEllips(inter2.norm) * mult2;
+    for (float t : {(-b2 - sq) / a, (-b2 + sq) / a}) {
+        if (t <= 0) {
+            continue;
         }
+        // Sphere-mapped sampling has area density 1 / (4 pi rx ry rz |s / r|)
+        // at the point radius * s; the normal there is along s / r.
+        glm::vec3 s_r = (o + dir * t) * inv_extent;
+        float s_r_length = glm::length(s_r);
+        float area_pdf = inv_extent.x * inv_extent.y * inv_extent.z / (4 * PI * s_r_length);
+        float cosine = std::abs(glm::dot(local_d, s_r)) / s_r_length;
+        p += area_pdf * t * t / cosine;
     }
     return p;
 }
 
-float LightDistribution::pdfBox() {
-    Box bval = std::get<Box>(obj.shape);
-    glm::vec3 size = bval.size;
-    float w = 8 * (size.x * size.y + size.x * size.z + size.y * size.z);
-    return 1 / w;
+glm::vec3 LightDistribution::sample_surface(float u_face, glm::vec2 u, glm::vec3& norm, float& area_pdf) {
+    glm::vec3 local;
+    glm::vec3 local_norm(0.0);
+    if (shape == LightShape::Box) {
+        // Faces are chosen by area, then one of the two opposite ones.
+        glm::vec3 face_areas(extent.y * extent.z, extent.x * extent.z, extent.x * extent.y);
+        float total = face_areas.x + face_areas.y + face_areas.z;
+        int axis = 0;
+        float u_axis = u_face * total;
+        while (axis < 2 && u_axis >= face_areas[axis]) {
+            u_axis -= face_areas[axis];
+            axis += 1;
+        }
+        float side = u_axis < face_areas[axis] / 2 ? -1 : 1;
+        int a1 = (axis + 1) % 3;
+        int a2 = (axis + 2) % 3;
+        local[axis] = side * extent[axis];
+        local[a1] = (2 * u.x - 1) * extent[a1];
+        local[a2] = (2 * u.y - 1) * extent[a2];
+        local_norm[axis] = side;
+        area_pdf = 1 / area;
+    }
+    else {
+        // Same sphere mapping as ellips_sample(), see pdfEllips().
+        glm::vec3 s = sample_uniform_sphere(u.x, u.y);
+        local = s * extent;
+        local_norm = s * inv_extent;
+        area_pdf = inv_extent.x * inv_extent.y * inv_extent.z / (4 * PI * glm::length(local_norm));
+    }
+    norm = glm::normalize(rotation * local_norm);
+    return position + rotation * local;
+}
+
+float LightDistribution::surface_pdf(glm::vec3 point) {
+    if (shape == LightShape::Box) {
+        return 1 / area;
+    }
+    glm::vec3 s_r = inv_rotation * (point - position) * inv_extent * inv_extent;
+    return inv_extent.x * inv_extent.y * inv_extent.z / (4 * PI * glm::length(s_r));
 }
 
-float LightDistribution::pdfEllips(glm::vec3 norm) {
-    Ellips eval = std::get<Ellips>(obj.shape);
-    glm::vec3 radius = eval.radius;
-    glm::vec3 smth = glm::vec3(norm.x * radius.y * radius.z, radius.x * norm.y * radius.z, radius.x * radius.y * norm.z);
-    return 1 / (4 * 3.14 * glm::length(smth));
+float LightDistribution::power() {
+    return std::max(luminance, 0.f) * area;
 }
 
-MixDistribution::MixDistribution(CosineDistribution cosine, int seed) : Distribution(seed) {
+LightBounds LightDistribution::bounds() {
+    // Near-spherical ellipsoids are sampled in the cone of their bounding
+    // sphere, so their pdf is positive over the whole of that sphere.
+    if (near_spherical) {
+        return LightBounds(position - glm::vec3(max_extent), position + glm::vec3(max_extent), power());
+    }
+    glm::mat3 rotation_matrix = glm::mat3_cast(rotation);
+    glm::vec3 half_size;
+    for (int k = 0; k < 3; ++k) {
+        float sum = 0;
+        for (int j = 0; j < 3; ++j) {
+            if (shape == LightShape::Box) {
+                sum += std::abs(rotation_matrix[j][k]) * extent[j];
+            }
+            else {
+                sum += rotation_matrix[j][k] * rotation_matrix[j][k] * extent[j] * extent[j];
+            }
+        }
+        half_size[k] = shape == LightShape::Box ? sum : std::sqrt(sum);
+    }
+    return LightBounds(position - half_size, position + half_size, power());
+}
+
+MixDistribution::MixDistribution(CosineDistribution cosine) {
     this->cosine = cosine;
 }
 
-glm::vec3 MixDistribution::sample(glm::vec3 point, glm::vec3 norm) {
-    std::uniform_int_distribution<> bin(0, 1);
-    int group = bin(g);
-    if (group == 0 || lights.size() == 0) {
-        return cosine.sample(point, norm);
+glm::vec3 MixDistribution::sample(glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim) {
+    glm::vec2 u = sampler.get_2d(dim + DIM_BSDF_DIRECTION);
+    return sample(point, norm, u, sampler.get_1d(dim + DIM_BSDF_LOBE));
+}
+
+glm::vec3 MixDistribution::sample(glm::vec3 point, glm::vec3 norm, glm::vec2 u, float u_light) {
+    if (lights.size() == 0 || !can_select_light(point, norm)) {
+        return sample_cosine_hemisphere(norm, u.x, u.y);
     }
-    
-    std::uniform_int_distribution<> lightDist(0, lights.size() - 1);
-    int lightInd = lightDist(g);
-    return lights[lightInd].sample(point, norm);
+    if (u.x < 0.5) {
+        return sample_cosine_hemisphere(norm, 2 * u.x, u.y);
+    }
+    u.x = std::min(2 * u.x - 1, 0x1.fffffep-1f);
+
+    float u_face;
+    int lightInd = select_light(point, norm, u_light, u_face);
+    if (lightInd < 0) {
+        // No light was reachable in the selected subtree, the sample is wasted.
+        return -norm;
+    }
+    glm::vec3 d = lights[lightInd].sample(point, norm, u_face, u);
+    if (d == glm::vec3(0.0)) {
+        return -norm;
+    }
+    return d;
 }
 
+// Up to this many lights, testing a direction against all of them in one
+// vectorised pass is cheaper than culling them with the light BVH. The pdfs
+// of the crossed lights are still evaluated one by one. Without importance
+// the traversal only tests boxes, so it wins earlier.
+const int BATCHED_PDF_MAX_LIGHTS = 32;
+const int BATCHED_PDF_MAX_LIGHTS_POWER = 16;
+
 float MixDistribution::pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d) {
-    if (lights.size() == 0) {
+    const float eps = 1e-4;
+    if (lights.size() == 0 || !can_select_light(point, norm)) {
         return cosine.pdf(point, norm, d);
     }
     float p = 0.5 * cosine.pdf(point, norm, d);
-    int N = lights.size();
-    for (int i = 0; i < N; ++i) {
-        p += 0.5 / float(N) * lights[i].pdf(point, norm, d);
+    int batched_max = selection == LightSelection::Power ? BATCHED_PDF_MAX_LIGHTS_POWER : BATCHED_PDF_MAX_LIGHTS;
+    if (lights.size() <= batched_max) {
+        float crossed[BATCHED_PDF_MAX_LIGHTS];
+        light_records.crossed(point, d, crossed);
+        for (int i = 0; i < lights.size(); ++i) {
+            if (crossed[i] != 0) {
+                p += 0.5 * light_pmf(point, norm, i) * lights[i].pdf(point, norm, d);
+            }
+        }
+        return p;
     }
+    bool use_bvh = selection == LightSelection::Bvh;
+    light_bvh.for_each_crossed(point + norm * eps, d, point, norm, use_bvh, [&](int i, float pmf) {
+        if (!use_bvh) {
+            pmf = light_table.pmf[i];
+        }
+        p += 0.5 * pmf * lights[i].pdf(point, norm, d);
+    });
     return p;
 }
 
 void MixDistribution::add_light(LightDistribution light) {
+    if (object_lights.size() <= light.obj_id) {
+        object_lights.resize(light.obj_id + 1, -1);
+    }
+    object_lights[light.obj_id] = lights.size();
     lights.push_back(light);
+}
+
+void MixDistribution::build_light_table() {
+    std::vector<float> weights;
+    std::vector<LightBounds> bounds;
+    for (int i = 0; i < lights.size(); ++i) {
+        weights.push_back(lights[i].power());
+        bounds.push_back(lights[i].bounds());
+    }
+    light_table = AliasTable(weights);
+    light_bvh = LightBvh(bounds);
+    light_records = LightRecords(lights);
+}
+
+bool MixDistribution::can_select_light(glm::vec3 point, glm::vec3 norm) {
+    return selection == LightSelection::Power || light_bvh.importance(point, norm) > 0;
+}
+
+int MixDistribution::select_light(glm::vec3 point, glm::vec3 norm, float u, float& u_remapped) {
+    if (selection == LightSelection::Power) {
+        return light_table.sample(u, u_remapped);
+    }
+    float pmf;
+    return light_bvh.sample(point, norm, u, u_remapped, pmf);
+}
+
+float MixDistribution::light_pmf(glm::vec3 point, glm::vec3 norm, int light_id) {
+    if (selection == LightSelection::Power) {
+        return light_table.pmf[light_id];
+    }
+    return light_bvh.pmf(point, norm, light_id);
+}
+
+glm::vec3 MixDistribution::sample_light(glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim, int& light_id) {
+    float u_select = sampler.get_1d(dim + DIM_LIGHT_SELECT);
+    glm::vec2 u_position = sampler.get_2d(dim + DIM_LIGHT_POSITION);
+    return sample_light(point, norm, u_select, u_position, light_id);
+}
+
+glm::vec3 MixDistribution::sample_light(glm::vec3 point, glm::vec3 norm, float u_select, glm::vec2 u_position, int& light_id) {
+    light_id = -1;
+    if (lights.size() == 0 || !can_select_light(point, norm)) {
+        return norm;
+    }
+    float u_face;
+    light_id = select_light(point, norm, u_select, u_face);
+    if (light_id < 0) {
+        return norm;
+    }
+    return lights[light_id].sample(point, norm, u_face, u_position);
+}
+
+float MixDistribution::light_pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d, int light_id) {
+    if (!can_select_light(point, norm)) {
+        return 0;
+    }
+    return lights[light_id].pdf(point, norm, d) * light_pmf(point, norm, light_id);
+}
+
+int MixDistribution::light_index(int obj_id) {
+    if (obj_id >= object_lights.size()) {
+        return -1;
+    }
+    return object_lights[obj_id];
+}
+
+LightRecords::LightRecords(const std::vector<LightDistribution>& lights) {
+    for (const LightDistribution& light : lights) {
+        glm::mat3 m = glm::mat3_cast(light.inv_rotation);
+        // Cone sampling covers the whole bounding sphere.
+        glm::vec3 light_inv_extent = light.near_spherical ? glm::vec3(1 / light.max_extent) : light.inv_extent;
+        for (int k = 0; k < 3; ++k) {
+            position[k].push_back(light.position[k]);
+            inv_extent[k].push_back(light_inv_extent[k]);
+            for (int j = 0; j < 3; ++j) {
+                inv_rotation[3 * k + j].push_back(m[j][k]);
+            }
+        }
+        is_box.push_back(light.shape == LightShape::Box ? 1 : 0);
+    }
+}
+
+void LightRecords::crossed(glm::vec3 point, glm::vec3 d, float* __restrict crossed) const {
+    // Slightly enlarged shapes keep rounding from culling grazing hits that
+    // the exact pdf would accept.
+    const float grow = 1 + 1e-4;
+    int n = size();
+    const float* px = position[0].data();
+    const float* py = position[1].data();
+    const float* pz = position[2].data();
+    const float* m0 = inv_rotation[0].data();
+    const float* m1 = inv_rotation[1].data();
+    const float* m2 = inv_rotation[2].data();
+    const float* m3 = inv_rotation[3].data();
+    const float* m4 = inv_rotation[4].data();
+    const float* m5 = inv_rotation[5].data();
+    const float* m6 = inv_rotation[6].data();
+    const float* m7 = inv_rotation[7].data();
+    const float* m8 = inv_rotation[8].data();
+    const float* ix = inv_extent[0].data();
+    const float* iy = inv_extent[1].data();
+    const float* iz = inv_extent[2].data();
+    const float* box = is_box.data();
+    float point_x = point.x;
+    float point_y = point.y;
+    float point_z = point.z;
+    float d_x = d.x;
+    float d_y = d.y;
+    float d_z = d.z;
+    for (int i = 0; i < n; ++i) {
+        // Ray in the frame where the light is the unit sphere or cube.
+        float dx = point_x - px[i];
+        float dy = point_y - py[i];
+        float dz = point_z - pz[i];
+        float ox = (m0[i] * dx + m1[i] * dy + m2[i] * dz) * ix[i];
+        float oy = (m3[i] * dx + m4[i] * dy + m5[i] * dz) * iy[i];
+        float oz = (m6[i] * dx + m7[i] * dy + m8[i] * dz) * iz[i];
+        float vx = (m0[i] * d_x + m1[i] * d_y + m2[i] * d_z) * ix[i];
+        float vy = (m3[i] * d_x + m4[i] * d_y + m5[i] * d_z) * iy[i];
+        float vz = (m6[i] * d_x + m7[i] * d_y + m8[i] * d_z) * iz[i];
+
+        float a = vx * vx + vy * vy + vz * vz;
+        float b = ox * vx + oy * vy + oz * vz;
+        float c = ox * ox + oy * oy + oz * oz - grow * grow;
+        float s = b / a;
+        float lx = ox - vx * s;
+        float ly = oy - vy * s;
+        float lz = oz - vz * s;
+        float disc = grow * grow - (lx * lx + ly * ly + lz * lz);
+        // The far root is positive if the ray starts inside or moves towards the center.
+        float ellips_hit = (disc >= 0) & ((c < 0) | (b < 0)) ? 1 : 0;
+
+        float rx = 1 / vx;
+        float ry = 1 / vy;
+        float rz = 1 / vz;
+        float t_near = std::max(std::max(std::min((-grow - ox) * rx, (grow - ox) * rx),
+            std::min((-grow - oy) * ry, (grow - oy) * ry)), std::min((-grow - oz) * rz, (grow - oz) * rz));
+        float t_far = std::min(std::min(std::max((-grow - ox) * rx, (grow - ox) * rx),
+            std::max((-grow - oy) * ry, (grow - oy) * ry)), std::max((-grow - oz) * rz, (grow - oz) * rz));
+        float box_hit = (t_near <= t_far) & (t_far >= 0) ? 1 : 0;
+
+        crossed[i] = box[i] != 0 ? box_hit : ellips_hit;
+    }
+}
+
+AliasTable::AliasTable(const std::vector<float>& weights) {
+    int n = weights.size();
+    pmf.assign(n, 0);
+    prob.assign(n, 1);
+    alias.assign(n, 0);
+    float total = 0;
+    for (int i = 0; i < n; ++i) {
+        total += weights[i];
+    }
+    for (int i = 0; i < n; ++i) {
+        pmf[i] = total > 0 ? weights[i] / total : 1 / float(n);
+        alias[i] = i;
+    }
+
+    std::vector<float> scaled(n);
+    std::vector<int> small;
+    std::vector<int> large;
+    for (int i = 0; i < n; ++i) {
+        scaled[i] = pmf[i] * n;
+        if (scaled[i] < 1) {
+            small.push_back(i);
+        }
+        else {
+            large.push_back(i);
+        }
+    }
+    while (!small.empty() && !large.empty()) {
+        int s = small.back();
+        small.pop_back();
+        int l = large.back();
+        prob[s] = scaled[s];
+        alias[s] = l;
+        scaled[l] -= 1 - scaled[s];
+        if (scaled[l] < 1) {
+            large.pop_back();
+            small.push_back(l);
+        }
+    }
+    // Whatever is left only differs from 1 by rounding.
+    for (int i : small) {
+        prob[i] = 1;
+    }
+    for (int i : large) {
+        prob[i] = 1;
+    }
+}
+
+int AliasTable::sample(float u, float& u_remapped) {
+    int n = prob.size();
+    float u_select = u * n;
+    int i = std::min(int(u_select), n - 1);
+    float f = std::min(u_select - i, 0x1.fffffep-1f);
+    if (f < prob[i]) {
+        u_remapped = std::min(f / prob[i], 0x1.fffffep-1f);
+        return i;
+    }
+    u_remapped = std::min((f - prob[i]) / (1 - prob[i]), 0x1.fffffep-1f);
+    return alias[i];
 }
\ No newline at end of file
@@ -5,52 +5,134 @@
 #include <glm/vec4.hpp>
 #include <glm/gtx/quaternion.hpp>
 #include "structures.h"
+#include "random.h"
+#include "sampler.h"
+#include "light_bvh.h"
 
 #pragma once
 
-struct Distribution {
+// The distributions share the sample/pdf interface but are called through
+// their concrete types, so every call is statically dispatched. In sample(),
+// dim is the first dimension of the current bounce, see bounce_dimension().
 
-    std::minstd_rand g;
-
-    Distribution() {};
-    Distribution(int seed);
-
-    virtual glm::vec3 sample(glm::vec3 point, glm::vec3 norm) = 0;
-    virtual float pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d) = 0;
-};
-
-struct CosineDistribution : public Distribution {
+struct CosineDistribution {
     CosineDistribution() {};
-    CosineDistribution(int seed);
 
-    glm::vec3 sample(glm::vec3 point, glm::vec3 norm) override;
-    float pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d) override;
+    glm::vec3 sample(glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim);
+    float pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d);
 };
 
-struct LightDistribution : public Distribution {
-    Object obj;
+enum class LightShape {Box, Ellips};
+
+// Emitting box or ellipsoid, with the geometry needed for sampling cached
+// when the light is registered.
+struct LightDistribution {
+    // Index of the emitting object in Scene::objects.
+    int obj_id;
+    LightShape shape;
+    glm::vec3 position;
+    glm::quat rotation;
+    glm::quat inv_rotation;
+    // Half size of a box or radii of an ellipsoid.
+    glm::vec3 extent;
+    glm::vec3 inv_extent;
+    float max_extent;
+    bool near_spherical;
+    float area;
+    float luminance;
 
     LightDistribution() {};
-    LightDistribution(int seed, Object obj);
+    LightDistribution(const Object& obj, int obj_id);
 
-    glm::vec3 sample(glm::vec3 point, glm::vec3 norm) override;
-    float pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d) override;
+    glm::vec3 sample(glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim);
+    // Returns a zero vector if the light cannot be sampled from point.
+    glm::vec3 sample(glm::vec3 point, glm::vec3 norm, float u_face, glm::vec2 u);
+    float pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d);
+    // Point on the surface for emitting photons, with its outward normal and
+    // density with respect to area.
+    glm::vec3 sample_surface(float u_face, glm::vec2 u, glm::vec3& norm, float& area_pdf);
+    // Area density of sample_surface() at a point on the light.
+    float surface_pdf(glm::vec3 point);
+    float power();
+    LightBounds bounds();
 
     private:
-    glm::vec3 box_sample(glm::vec3 point, glm::vec3 norm, glm::vec3 size);
-    glm::vec3 ellips_sample(glm::vec3 point, glm::vec3 norm, glm::vec3 radius);
-    float pdfBox();
-    float pdfEllips(glm::vec3 norm);
+    bool uses_sphere_cap(glm::vec3 point);
+    glm::vec3 box_sample(glm::vec3 point, float u_face, glm::vec2 u);
+    glm::vec3 sphere_cap_sample(glm::vec3 point, glm::vec2 u);
+    glm::vec3 ellips_sample(glm::vec3 point, glm::vec2 u);
+    float pdfBox(glm::vec3 point, glm::vec3 d);
+    float pdfSphereCap(glm::vec3 point, glm::vec3 d);
+    float pdfEllips(glm::vec3 point, glm::vec3 d);
+};
+
+// Walker's alias method: O(1) sampling of a discrete distribution.
+struct AliasTable {
+    std::vector<float> pmf;
+    std::vector<float> prob;
+    std::vector<int> alias;
+
+    AliasTable() {};
+    AliasTable(const std::vector<float>& weights);
+
+    // u_remapped receives a fresh uniform number derived from u.
+    int sample(float u, float& u_remapped);
 };
 
-struct MixDistribution : public Distribution {
+// Structure-of-arrays copy of the light records, so that one direction can
+// be tested against many lights at once with vector instructions. Only the
+// hit test is batched: a direction rarely hits more than one light, so the
+// exact pdf is cheaper evaluated per crossed light.
+struct LightRecords {
+    std::vector<float> position[3];
+    // Inverse rotation as a row-major 3x3 matrix.
+    std::vector<float> inv_rotation[9];
+    std::vector<float> inv_extent[3];
+    std::vector<float> is_box;
+
+    LightRecords() {};
+    LightRecords(const std::vector<LightDistribution>& lights);
+
+    int size() const {
+        return is_box.size();
+    }
+    // Sets crossed[i] to 1 if the ray from point along d may hit light i and
+    // to 0 if it surely misses it.
+    void crossed(glm::vec3 point, glm::vec3 d, float* crossed) const;
+};
+
+enum class LightSelection {Power, Bvh};
+
+struct MixDistribution {
     std::vector<LightDistribution> lights;
+    std::vector<int> object_lights;
+    LightSelection selection = LightSelection::Bvh;
+    AliasTable light_table;
+    LightBvh light_bvh;
+    LightRecords light_records;
     CosineDistribution cosine;
 
     MixDistribution() {};
-    MixDistribution(CosineDistribution cosine, int seed);
+    MixDistribution(CosineDistribution cosine);
 
-    glm::vec3 sample(glm::vec3 point, glm::vec3 norm) override;
-    float pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d) override;
+    glm::vec3 sample(glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim);
+    // u chooses the strategy and the direction, u_light selects the light.
+    glm::vec3 sample(glm::vec3 point, glm::vec3 norm, glm::vec2 u, float u_light);
+    float pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d);
     void add_light(LightDistribution light);
+    // Builds the light selection structures, must be called after the last add_light.
+    void build_light_table();
+
+    // Light sampling for next-event estimation, reads the light dimensions of the bounce.
+    // light_id is -1 if no light can be selected for the receiver.
+    glm::vec3 sample_light(glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim, int& light_id);
+    glm::vec3 sample_light(glm::vec3 point, glm::vec3 norm, float u_select, glm::vec2 u_position, int& light_id);
+    float light_pdf(glm::vec3 point, glm::vec3 norm, glm::vec3 d, int light_id);
+    // Index in lights of the light for a scene object, -1 if the object is not a light.
+    int light_index(int obj_id);
+
+    private:
+    bool can_select_light(glm::vec3 point, glm::vec3 norm);
+    int select_light(glm::vec3 point, glm::vec3 norm, float u, float& u_remapped);
+    float light_pmf(glm::vec3 point, glm::vec3 norm, int light_id);
 };
\ No newline at end of file
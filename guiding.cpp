@@ -0,0 +1,240 @@
+#include "guiding.h"
+#include <algorithm>
+#include <cmath>
+#include "random.h"
+
+// Cells with more than this fraction of the energy get subdivided.
+const float QUADTREE_SUBDIVIDE_FRACTION = 0.01;
+const int QUADTREE_MAX_DEPTH = 20;
+// A spatial leaf splits once it records more than this many samples times
+// the square root of the samples per pixel of the pass.
+const float SPATIAL_SPLIT_RECORDS = 4000;
+const int SPATIAL_MAX_DEPTH = 24;
+
+glm::vec2 direction_to_square(glm::vec3 d) {
+    float cos_theta = std::clamp(d.z, -1.f, 1.f);
+    float phi = std::atan2(d.y, d.x);
+    if (phi < 0) {
+        phi += 2 * PI;
+    }
+    glm::vec2 p((cos_theta + 1) / 2, phi / (2 * PI));
+    return glm::clamp(p, glm::vec2(0), glm::vec2(0x1.fffffep-1f));
+}
+
+glm::vec3 square_to_direction(glm::vec2 p) {
+    float cos_theta = 2 * p.x - 1;
+    float sin_theta = std::sqrt(std::max(0.f, 1 - cos_theta * cos_theta));
+    float phi = 2 * PI * p.y;
+    return glm::vec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+}
+
+DirectionalTree::DirectionalTree() {
+    nodes.push_back(QuadtreeNode());
+}
+
+float DirectionalTree::total() const {
+    const QuadtreeNode& root = nodes[0];
+    return root.sum[0] + root.sum[1] + root.sum[2] + root.sum[3];
+}
+
+void DirectionalTree::record(glm::vec3 d, float value) {
+    records += 1;
+    if (!(value > 0) || std::isinf(value)) {
+        return;
+    }
+    glm::vec2 p = direction_to_square(d);
+    int index = 0;
+    while (true) {
+        int qx = p.x >= 0.5;
+        int qy = p.y >= 0.5;
+        int q = qx + 2 * qy;
+        nodes[index].sum[q] += value;
+        if (nodes[index].child[q] < 0) {
+            return;
+        }
+        p = p * 2.f - glm::vec2(qx, qy);
+        index = nodes[index].child[q];
+    }
+}
+
+glm::vec3 DirectionalTree::sample(glm::vec2 u) const {
+    glm::vec2 origin(0);
+    float size = 1;
+    int index = 0;
+    while (true) {
+        const QuadtreeNode& node = nodes[index];
+        float total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+        if (total <= 0) {
+            return square_to_direction(origin + u * size);
+        }
+        int qx = 0;
+        float p_left = (node.sum[0] + node.sum[2]) / total;
+        if (u.x < p_left) {
+            u.x = std::min(u.x / p_left, 0x1.fffffep-1f);
+        }
+        else {
+            qx = 1;
+            u.x = std::min((u.x - p_left) / (1 - p_left), 0x1.fffffep-1f);
+        }
+        int qy = 0;
+        float column = node.sum[qx] + node.sum[qx + 2];
+        float p_bottom = column > 0 ? node.sum[qx] / column : 0.5f;
+        if (u.y < p_bottom) {
+            u.y = std::min(u.y / p_bottom, 0x1.fffffep-1f);
+        }
+        else {
+            qy = 1;
+            u.y = std::min((u.y - p_bottom) / (1 - p_bottom), 0x1.fffffep-1f);
+        }
+        size /= 2;
+        origin += glm::vec2(qx, qy) * size;
+        int q = qx + 2 * qy;
+        if (node.child[q] < 0) {
+            return square_to_direction(origin + u * size);
+        }
+        index = node.child[q];
+    }
+}
+
+float DirectionalTree::pdf(glm::vec3 d) const {
+    glm::vec2 p = direction_to_square(d);
+    float density = 1;
+    int index = 0;
+    while (index >= 0) {
+        const QuadtreeNode& node = nodes[index];
+        float total = node.sum[0] + node.sum[1] + node.sum[2] + node.sum[3];
+        if (total <= 0) {
+            break;
+        }
+        int qx = p.x >= 0.5;
+        int qy = p.y >= 0.5;
+        int q = qx + 2 * qy;
+        density *= 4 * node.sum[q] / total;
+        p = p * 2.f - glm::vec2(qx, qy);
+        index = node.child[q];
+    }
+    return density / (4 * PI);
+}
+
+DirectionalTree DirectionalTree::refined() const {
+    DirectionalTree result;
+    float energy = total();
+    if (energy <= 0) {
+        return result;
+    }
+    struct Item {
+        int index;
+        // Node of this tree covering the same cell, -1 if it was a leaf here.
+        int old_index;
+        float old_sum;
+        int depth;
+    };
+    std::vector<Item> stack = {{0, 0, energy, 1}};
+    while (!stack.empty()) {
+        Item item = stack.back();
+        stack.pop_back();
+        for (int q = 0; q < 4; ++q) {
+            float sum = item.old_index >= 0 ? nodes[item.old_index].sum[q] : item.old_sum / 4;
+            if (sum / energy <= QUADTREE_SUBDIVIDE_FRACTION || item.depth >= QUADTREE_MAX_DEPTH) {
+                continue;
+            }
+            int child = result.nodes.size();
+            result.nodes.push_back(QuadtreeNode());
+            result.nodes[item.index].child[q] = child;
+            int old_child = item.old_index >= 0 ? nodes[item.old_index].child[q] : -1;
+            stack.push_back({child, old_child, sum, item.depth + 1});
+        }
+    }
+    return result;
+}
+
+float GuidingLeaf::selection_probability() const {
+    if (sampling.total() <= 0) {
+        return 0;
+    }
+    return 1 / (1 + std::exp(-theta));
+}
+
+void GuidingLeaf::train_selection(float value, float guide_pdf, float other_pdf) {
+    const float learning_rate = 0.01;
+    const float beta1 = 0.9;
+    const float beta2 = 0.999;
+    const float weight_decay = 0.01;
+    float alpha = selection_probability();
+    float pdf = alpha * guide_pdf + (1 - alpha) * other_pdf;
+    if (!(value >= 0) || std::isinf(value) || pdf <= 0) {
+        return;
+    }
+    // d/d theta of KL(value || pdf), estimated from a sample drawn from pdf.
+    float gradient = -value / (pdf * pdf) * (guide_pdf - other_pdf) * alpha * (1 - alpha);
+    gradient += weight_decay * theta;
+    adam_step += 1;
+    adam_m = beta1 * adam_m + (1 - beta1) * gradient;
+    adam_v = beta2 * adam_v + (1 - beta2) * gradient * gradient;
+    float m_hat = adam_m / (1 - std::pow(beta1, adam_step));
+    float v_hat = adam_v / (1 - std::pow(beta2, adam_step));
+    theta -= learning_rate * m_hat / (std::sqrt(v_hat) + 1e-8f);
+    theta = std::clamp(theta, -10.f, 10.f);
+}
+
+GuidingField::GuidingField(glm::vec3 min, glm::vec3 max) {
+    this->min = min;
+    this->max = max;
+    nodes.push_back(SpatialNode());
+    nodes[0].leaf = 0;
+    leaves.push_back(GuidingLeaf());
+}
+
+int GuidingField::leaf_index(glm::vec3 point) const {
+    glm::vec3 p = glm::clamp((point - min) / (max - min), glm::vec3(0), glm::vec3(1));
+    int index = 0;
+    while (nodes[index].leaf < 0) {
+        int axis = nodes[index].axis;
+        if (p[axis] < 0.5) {
+            p[axis] *= 2;
+            index = nodes[index].child[0];
+        }
+        else {
+            p[axis] = p[axis] * 2 - 1;
+            index = nodes[index].child[1];
+        }
+    }
+    return nodes[index].leaf;
+}
+
+void GuidingField::refine(int samples_per_pixel) {
+    float threshold = SPATIAL_SPLIT_RECORDS * std::sqrt(float(samples_per_pixel));
+    std::vector<std::pair<int, int>> stack = {{0, 0}};
+    while (!stack.empty()) {
+        auto [index, depth] = stack.back();
+        stack.pop_back();
+        if (nodes[index].leaf < 0) {
+            stack.push_back({nodes[index].child[0], depth + 1});
+            stack.push_back({nodes[index].child[1], depth + 1});
+            continue;
+        }
+        int leaf = nodes[index].leaf;
+        if (leaves[leaf].building.records <= threshold || depth >= SPATIAL_MAX_DEPTH) {
+            continue;
+        }
+        // Both halves start from the parent's distribution.
+        GuidingLeaf half = leaves[leaf];
+        half.building.records /= 2;
+        leaves[leaf] = half;
+        leaves.push_back(half);
+        nodes[index].axis = depth % 3;
+        for (int i = 0; i < 2; ++i) {
+            SpatialNode child;
+            child.leaf = i == 0 ? leaf : int(leaves.size()) - 1;
+            nodes[index].child[i] = nodes.size();
+            nodes.push_back(child);
+        }
+        nodes[index].leaf = -1;
+        stack.push_back({nodes[index].child[0], depth + 1});
+        stack.push_back({nodes[index].child[1], depth + 1});
+    }
+    for (GuidingLeaf& leaf : leaves) {
+        leaf.sampling = leaf.building;
+        leaf.building = leaf.sampling.refined();
+    }
+}
@@ -0,0 +1,83 @@
+#include <vector>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+#pragma once
+
+// Path guiding with SD-trees (Mueller et al. 2017, "Practical Path Guiding
+// for Efficient Light-Transport Simulation"). A binary tree over space holds
+// in every leaf a quadtree over directions, which approximates the incident
+// radiance there. Training passes with doubling sample counts record
+// radiance into one copy of the quadtree while sampling from the copy
+// learned in the previous pass.
+
+// Directions map to [0, 1]^2 through the area-preserving cylindrical
+// mapping (cos theta, phi / 2 pi), so the directional pdf is the density on
+// the square divided by 4 pi.
+glm::vec2 direction_to_square(glm::vec3 d);
+glm::vec3 square_to_direction(glm::vec2 p);
+
+struct QuadtreeNode {
+    float sum[4] = {0, 0, 0, 0};
+    int child[4] = {-1, -1, -1, -1};
+};
+
+struct DirectionalTree {
+    std::vector<QuadtreeNode> nodes;
+    float records = 0;
+
+    DirectionalTree();
+
+    float total() const;
+    void record(glm::vec3 d, float value);
+    glm::vec3 sample(glm::vec2 u) const;
+    float pdf(glm::vec3 d) const;
+    // Same structure with every cell holding more than a small fraction of
+    // the energy subdivided and the others collapsed, with cleared sums.
+    DirectionalTree refined() const;
+};
+
+struct GuidingLeaf {
+    DirectionalTree sampling;
+    DirectionalTree building;
+    // Logit of the probability to sample the guiding distribution instead
+    // of the regular one, trained with Adam to minimise the KL divergence
+    // to the integrand (Mueller 2019, "Practical Path Guiding in Production").
+    float theta = 0;
+    float adam_m = 0;
+    float adam_v = 0;
+    int adam_step = 0;
+
+    float selection_probability() const;
+    // guide_pdf and other_pdf are the densities of the two strategies for a
+    // sampled direction, value the integrand there.
+    void train_selection(float value, float guide_pdf, float other_pdf);
+};
+
+struct SpatialNode {
+    int axis = 0;
+    int child[2] = {-1, -1};
+    int leaf = -1;
+};
+
+struct GuidingField {
+    glm::vec3 min;
+    glm::vec3 max;
+    std::vector<SpatialNode> nodes;
+    std::vector<GuidingLeaf> leaves;
+    // Set while a training pass records radiance.
+    bool training = false;
+
+    GuidingField() {};
+    GuidingField(glm::vec3 min, glm::vec3 max);
+
+    bool empty() const {
+        return nodes.empty();
+    }
+    // Leaf for a point, points outside the bounds use the closest leaf.
+    int leaf_index(glm::vec3 point) const;
+    // Ends a training pass with samples_per_pixel samples: splits leaves that
+    // recorded many samples and makes the recorded radiance the new sampling
+    // distribution.
+    void refine(int samples_per_pixel);
+};
@@ -0,0 +1,150 @@
+#include "half.h"
+#include <algorithm>
+#include <bit>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HALF_F16C
+#include <immintrin.h>
+#endif
+
+const float HALF_MAX = 65504;
+// Values converted per F16C instruction.
+const int HALF_LANES = 8;
+
+float saturate_half(float value) {
+    if (value > HALF_MAX) {
+        return HALF_MAX;
+    }
+    if (value < -HALF_MAX) {
+        return -HALF_MAX;
+    }
+    return value;
+}
+
+// Rounds through the float adder (Giesen, "Float->half variants"): small
+// values are added to a magic number whose last mantissa bits are the half
+// subnormals, normal ones are rebiased and rounded to 10 mantissa bits.
+uint16_t float_to_half(float value) {
+    uint32_t bits = std::bit_cast<uint32_t>(saturate_half(value));
+    uint32_t sign = bits >> 16 & 0x8000;
+    bits &= 0x7fffffff;
+    if (bits > 0x7f800000) {
+        return sign | 0x7e00;
+    }
+    if (bits < 113u << 23) {
+        const uint32_t magic = 126u << 23;
+        float shifted = std::bit_cast<float>(bits) + std::bit_cast<float>(magic);
+        return sign | (std::bit_cast<uint32_t>(shifted) - magic);
+    }
+    uint32_t odd = bits >> 13 & 1;
+    bits += (uint32_t(15 - 127) << 23) + 0xfff + odd;
+    return sign | bits >> 13;
+}
+
+float half_to_float(uint16_t half) {
+    const uint32_t exponent_mask = 0x7c00u << 13;
+    uint32_t bits = (half & 0x7fffu) << 13;
+    uint32_t exponent = bits & exponent_mask;
+    bits += (127u - 15) << 23;
+    if (exponent == exponent_mask) {
+        bits += (128u - 16) << 23;
+    }
+    else if (exponent == 0) {
+        bits += 1 << 23;
+        bits = std::bit_cast<uint32_t>(std::bit_cast<float>(bits) - std::bit_cast<float>(113u << 23));
+    }
+    return std::bit_cast<float>(bits | uint32_t(half & 0x8000) << 16);
+}
+
+#ifdef HALF_F16C
+bool has_f16c() {
+    static const bool supported = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    return supported;
+}
+
+// The constants go first in the clamps, so that NaN passes through them.
+__attribute__((target("avx,f16c"))) __m128i float_to_half_lanes(const float* values) {
+    __m256 v = _mm256_loadu_ps(values);
+    v = _mm256_min_ps(_mm256_set1_ps(HALF_MAX), _mm256_max_ps(_mm256_set1_ps(-HALF_MAX), v));
+    return _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT);
+}
+
+__attribute__((target("avx,f16c"))) void float_to_half_f16c(const float* values, uint16_t* halves, size_t count) {
+    size_t i = 0;
+    for (; i + HALF_LANES <= count; i += HALF_LANES) {
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(halves + i), float_to_half_lanes(values + i));
+    }
+    if (i < count) {
+        float rest[HALF_LANES] = {};
+        uint16_t converted[HALF_LANES];
+        std::copy(values + i, values + count, rest);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(converted), float_to_half_lanes(rest));
+        std::copy(converted, converted + (count - i), halves + i);
+    }
+}
+
+__attribute__((target("avx,f16c"))) void half_to_float_f16c(const uint16_t* halves, float* values, size_t count) {
+    size_t i = 0;
+    for (; i + HALF_LANES <= count; i += HALF_LANES) {
+        _mm256_storeu_ps(values + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(halves + i))));
+    }
+    if (i < count) {
+        uint16_t rest[HALF_LANES] = {};
+        float converted[HALF_LANES];
+        std::copy(halves + i, halves + count, rest);
+        _mm256_storeu_ps(converted, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(rest))));
+        std::copy(converted, converted + (count - i), values + i);
+    }
+}
+#endif
+
+void float_to_half(const float* values, uint16_t* halves, size_t count) {
+#ifdef HALF_F16C
+    if (has_f16c()) {
+        float_to_half_f16c(values, halves, count);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; ++i) {
+        halves[i] = float_to_half(values[i]);
+    }
+}
+
+void half_to_float(const uint16_t* halves, float* values, size_t count) {
+#ifdef HALF_F16C
+    if (has_f16c()) {
+        half_to_float_f16c(halves, values, count);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < count; ++i) {
+        values[i] = half_to_float(halves[i]);
+    }
+}
+
+void Vec3Buffer::read(size_t first, size_t count, glm::vec3* values) const {
+    if (half) {
+        half_to_float(halves.data() + first * 3, &values->x, count * 3);
+    }
+    else {
+        std::copy_n(floats.data() + first, count, values);
+    }
+}
+
+void Vec3Buffer::write(size_t first, size_t count, const glm::vec3* values) {
+    if (half) {
+        float_to_half(&values->x, halves.data() + first * 3, count * 3);
+    }
+    else {
+        std::copy_n(values, count, floats.data() + first);
+    }
+}
+
+const glm::vec3* Vec3Buffer::float_data(std::vector<glm::vec3>& storage) const {
+    if (!half) {
+        return floats.data();
+    }
+    storage.resize(size());
+    read(0, size(), storage.data());
+    return storage.data();
+}
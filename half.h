@@ -0,0 +1,64 @@
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <glm/vec3.hpp>
+
+#pragma once
+
+// IEEE 754 half precision, converted with the F16C instructions where the
+// processor has them and in software otherwise, rounding to nearest even.
+// Values beyond the largest half, 65504, are stored as that value rather
+// than as infinity.
+void float_to_half(const float* values, uint16_t* halves, size_t count);
+void half_to_float(const uint16_t* halves, float* values, size_t count);
+
+// Plane of vec3 values per pixel, kept as floats or, in half the memory, as
+// halves.
+struct Vec3Buffer {
+    bool half = false;
+    std::vector<glm::vec3> floats;
+    std::vector<uint16_t> halves;
+
+    Vec3Buffer() = default;
+    Vec3Buffer(size_t count, bool half_precision) {
+        half = half_precision;
+        if (half) {
+            halves.assign(count * 3, 0);
+        }
+        else {
+            floats.assign(count, glm::vec3(0.0));
+        }
+    }
+
+    size_t size() const {
+        return half ? halves.size() / 3 : floats.size();
+    }
+
+    const glm::vec3 operator[](size_t i) const {
+        if (!half) {
+            return floats[i];
+        }
+        glm::vec3 value;
+        half_to_float(&halves[i * 3], &value.x, 3);
+        return value;
+    }
+
+    void set(size_t i, glm::vec3 value) {
+        if (half) {
+            float_to_half(&value.x, &halves[i * 3], 3);
+        }
+        else {
+            floats[i] = value;
+        }
+    }
+
+    // Copies count values from the one at first into values, or back.
+    void read(size_t first, size_t count, glm::vec3* values) const;
+    void write(size_t first, size_t count, const glm::vec3* values);
+    // All values as floats, the buffer's own or converted into storage.
+    const glm::vec3* float_data(std::vector<glm::vec3>& storage) const;
+
+    size_t memory() const {
+        return floats.size() * sizeof(glm::vec3) + halves.size() * sizeof(uint16_t);
+    }
+};
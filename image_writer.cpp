@@ -2,10 +2,562 @@
 #include <string>
 #include <fstream>
 #include <iostream>
+#include <bit>
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <glm/geometric.hpp>
+#include "deflate.h"
 
-void write_ppm_pixels(std::string filename, ScenePixels scene) {
+// Longest run and shortest repeat run of the OpenEXR run-length coding.
+const int EXR_MAX_RUN = 127;
+const int EXR_MIN_RUN = 3;
+// Uncompressed bytes of the rows deflated together. Parts are compressed
+// independently, so larger ones compress slightly better and smaller ones
+// spread over more threads.
+const size_t PNG_PART_BYTES = 1 << 20;
+const int QOI_MAX_RUN = 62;
+
+PpmStream::PpmStream(std::string filename, int width, int height) {
+    this->width = width;
+    this->height = height;
+    if (filename == "-") {
+        out = &std::cout;
+    }
+    else {
+        file.open(filename, std::ios::binary);
+        out = &file;
+    }
+    *out << "P6\n" << width << ' ' << height << "\n255\n";
+}
+
+void PpmStream::write_row(int y, const Color* row) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (y != next_row) {
+        pending.emplace(y, std::vector<Color>(row, row + width));
+        return;
+    }
+    out->write(reinterpret_cast<const char*>(row), size_t(width) * 3);
+    ++next_row;
+    for (auto it = pending.begin(); it != pending.end() && it->first == next_row; it = pending.erase(it)) {
+        out->write(reinterpret_cast<const char*>(it->second.data()), size_t(width) * 3);
+        ++next_row;
+    }
+    out->flush();
+}
+
+MappedImage::MappedImage(std::string filename, int width, int height, bool pfm, int sync_rows) {
+    this->width = width;
+    this->height = height;
+    this->pfm = pfm;
+    this->sync_rows = sync_rows;
+    std::string header;
+    if (pfm) {
+        header = std::string("PF\n") + std::to_string(width) + ' ' + std::to_string(height) + (std::endian::native == std::endian::little ? "\n-1\n" : "\n1\n");
+    }
+    else {
+        header = "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+    }
+    header_size = header.size();
+    size = header_size + size_t(width) * height * (pfm ? 3 * sizeof(float) : 3);
+    fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0) {
+        return;
+    }
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapping == MAP_FAILED) {
+        return;
+    }
+    data = static_cast<unsigned char*>(mapping);
+    std::memcpy(data, header.data(), header_size);
+}
+
+MappedImage::~MappedImage() {
+    if (data) {
+        munmap(data, size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+bool MappedImage::valid() const {
+    return data != nullptr;
+}
+
+void MappedImage::write_row(int y, const Color* row) {
+    write_span(0, y, width, row);
+}
+
+void MappedImage::write_row(int y, const glm::vec3* row) {
+    write_span(0, y, width, row);
+}
+
+void MappedImage::write_span(int x, int y, int count, const Color* pixels) {
+    std::memcpy(data + header_size + (size_t(y) * width + x) * 3, pixels, size_t(count) * 3);
+    pixels_finished(count);
+}
+
+void MappedImage::write_span(int x, int y, int count, const glm::vec3* pixels) {
+    // PFM rows go from the bottom up.
+    std::memcpy(data + header_size + (size_t(height - 1 - y) * width + x) * 3 * sizeof(float), pixels, size_t(count) * 3 * sizeof(float));
+    pixels_finished(count);
+}
+
+void MappedImage::pixels_finished(int count) {
+    size_t before = finished_pixels.fetch_add(count);
+    size_t after = before + count;
+    size_t batch = size_t(sync_rows) * width;
+    if (sync_rows > 0 && (before / batch != after / batch || after == size_t(width) * height)) {
+        msync(data, size, MS_ASYNC);
+    }
+}
+
+void write_ppm_pixels(std::string filename, const ScenePixels& scene) {
+    PpmStream stream(filename, scene.width, scene.height);
+    for (int y = 0; y < scene.height; ++y) {
+        stream.write_row(y, &scene.pixels[size_t(y) * scene.width]);
+    }
+}
+
+void write_pfm_header(std::ostream& out, int width, int height, int channels) {
+    // A negative scale marks little-endian data.
+    float scale = std::endian::native == std::endian::little ? -1 : 1;
+    out << (channels == 3 ? "PF" : "Pf") << '\n' << width << ' ' << height << '\n' << scale << '\n';
+}
+
+void write_pfm(std::string filename, int width, int height, int channels, const float* data) {
+    std::ofstream fout(filename, std::ios::binary);
+    write_pfm_header(fout, width, height, channels);
+    for (int y = height - 1; y >= 0; --y) {
+        fout.write(reinterpret_cast<const char*>(data + size_t(y) * width * channels), sizeof(float) * width * channels);
+    }
+    fout.close();
+}
+
+void write_pfm(std::string filename, int width, int height, const Vec3Buffer& colors) {
     std::ofstream fout(filename, std::ios::binary);
-    fout << "P6\n" << scene.width << ' ' << scene.height << "\n255\n";
-    fout.write(reinterpret_cast<char*>(scene.pixels.data()), scene.width * scene.height * 3);
+    write_pfm_header(fout, width, height, 3);
+    std::vector<glm::vec3> row(width);
+    for (int y = height - 1; y >= 0; --y) {
+        colors.read(size_t(y) * width, width, row.data());
+        fout.write(reinterpret_cast<const char*>(row.data()), sizeof(glm::vec3) * width);
+    }
     fout.close();
-}
\ No newline at end of file
+}
+
+bool read_pfm(std::string filename, Framebuffer& frame) {
+    std::ifstream fin(filename, std::ios::binary);
+    std::string magic;
+    int width, height;
+    float scale;
+    fin >> magic >> width >> height >> scale;
+    fin.get();
+    if (!fin || (magic != "PF" && magic != "Pf") || width <= 0 || height <= 0) {
+        return false;
+    }
+    int channels = magic == "PF" ? 3 : 1;
+    bool swap = (scale < 0) != (std::endian::native == std::endian::little);
+    std::vector<float> row(size_t(width) * channels);
+    std::vector<glm::vec3> colors(width);
+    frame = Framebuffer(width, height);
+    for (int y = height - 1; y >= 0; --y) {
+        if (!fin.read(reinterpret_cast<char*>(row.data()), sizeof(float) * row.size())) {
+            return false;
+        }
+        for (int x = 0; x < width; ++x) {
+            for (int c = 0; c < 3; ++c) {
+                float value = row[x * channels + c % channels];
+                if (swap) {
+                    uint32_t bits = std::bit_cast<uint32_t>(value);
+                    value = std::bit_cast<float>(bits >> 24 | (bits >> 8 & 0xff00) | (bits << 8 & 0xff0000) | bits << 24);
+                }
+                colors[x][c] = value;
+            }
+        }
+        frame.color.write(size_t(y) * width, width, colors.data());
+    }
+    return true;
+}
+
+void put_u32(std::vector<unsigned char>& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(value >> (8 * i) & 0xff);
+    }
+}
+
+void put_u64(std::vector<unsigned char>& out, uint64_t value) {
+    put_u32(out, value & 0xffffffff);
+    put_u32(out, value >> 32);
+}
+
+void put_attribute(std::vector<unsigned char>& out, const char* name, const char* type, const std::vector<unsigned char>& value) {
+    out.insert(out.end(), name, name + std::strlen(name) + 1);
+    out.insert(out.end(), type, type + std::strlen(type) + 1);
+    put_u32(out, value.size());
+    out.insert(out.end(), value.begin(), value.end());
+}
+
+// Byte planes of the OpenEXR zip and run-length compressors: the even bytes
+// followed by the odd ones, each the difference to the one before.
+std::vector<unsigned char> exr_predict(const std::vector<unsigned char>& raw) {
+    std::vector<unsigned char> planes(raw.size());
+    size_t half = (raw.size() + 1) / 2;
+    for (size_t i = 0; i < raw.size(); ++i) {
+        planes[i % 2 == 0 ? i / 2 : half + i / 2] = raw[i];
+    }
+    for (size_t i = planes.size(); i-- > 1;) {
+        planes[i] = planes[i] - planes[i - 1] + 128;
+    }
+    return planes;
+}
+
+// Runs of a repeated byte as its count minus one followed by the byte, other
+// bytes as their negated count followed by the bytes.
+std::vector<unsigned char> exr_run_length(const std::vector<unsigned char>& data) {
+    std::vector<unsigned char> out;
+    size_t n = data.size();
+    size_t start = 0;
+    while (start < n) {
+        size_t end = start + 1;
+        while (end < n && data[end] == data[start] && end - start < EXR_MAX_RUN + 1) {
+            ++end;
+        }
+        if (end - start >= EXR_MIN_RUN) {
+            out.push_back(end - start - 1);
+            out.push_back(data[start]);
+        }
+        else {
+            // Literal bytes stop where a run of three begins.
+            end = start;
+            while (end < n && end - start < EXR_MAX_RUN && !(end + 2 < n && data[end] == data[end + 1] && data[end] == data[end + 2])) {
+                ++end;
+            }
+            out.push_back(-int(end - start));
+            out.insert(out.end(), data.begin() + start, data.begin() + end);
+        }
+        start = end;
+    }
+    return out;
+}
+
+void write_exr(std::string filename, int width, int height, const glm::vec3* color, ExrCompression compression) {
+    std::vector<unsigned char> header = {0x76, 0x2f, 0x31, 0x01, 2, 0, 0, 0};
+    std::vector<unsigned char> channels;
+    for (const char* name : {"B", "G", "R"}) {
+        channels.push_back(name[0]);
+        channels.push_back(0);
+        // 32-bit float, not linear, sampled at every pixel.
+        put_u32(channels, 2);
+        put_u32(channels, 0);
+        put_u32(channels, 1);
+        put_u32(channels, 1);
+    }
+    channels.push_back(0);
+    put_attribute(header, "channels", "chlist", channels);
+    const unsigned char compression_ids[3] = {0, 1, 3};
+    put_attribute(header, "compression", "compression", {compression_ids[int(compression)]});
+    std::vector<unsigned char> window;
+    put_u32(window, 0);
+    put_u32(window, 0);
+    put_u32(window, width - 1);
+    put_u32(window, height - 1);
+    put_attribute(header, "dataWindow", "box2i", window);
+    put_attribute(header, "displayWindow", "box2i", window);
+    put_attribute(header, "lineOrder", "lineOrder", {0});
+    std::vector<unsigned char> one;
+    put_u32(one, std::bit_cast<uint32_t>(1.f));
+    put_attribute(header, "pixelAspectRatio", "float", one);
+    put_attribute(header, "screenWindowCenter", "v2f", std::vector<unsigned char>(8, 0));
+    put_attribute(header, "screenWindowWidth", "float", one);
+    header.push_back(0);
+
+    int lines = compression == ExrCompression::Zip ? 16 : 1;
+    int blocks = (height + lines - 1) / lines;
+    std::vector<std::vector<unsigned char>> chunks(blocks);
+    for (int block = 0; block < blocks; ++block) {
+        int y_begin = block * lines;
+        int y_end = std::min(height, y_begin + lines);
+        std::vector<unsigned char> raw;
+        raw.reserve(size_t(y_end - y_begin) * width * 12);
+        for (int y = y_begin; y < y_end; ++y) {
+            for (int c = 2; c >= 0; --c) {
+                for (int x = 0; x < width; ++x) {
+                    put_u32(raw, std::bit_cast<uint32_t>(color[x + size_t(y) * width][c]));
+                }
+            }
+        }
+        std::vector<unsigned char> data;
+        if (compression == ExrCompression::Rle) {
+            data = exr_run_length(exr_predict(raw));
+        }
+        else if (compression == ExrCompression::Zip) {
+            std::vector<unsigned char> planes = exr_predict(raw);
+            data = zlib_compress(planes.data(), planes.size());
+        }
+        // Blocks that do not get smaller are stored as they are.
+        if (compression == ExrCompression::None || data.size() >= raw.size()) {
+            data = std::move(raw);
+        }
+        std::vector<unsigned char>& chunk = chunks[block];
+        put_u32(chunk, y_begin);
+        put_u32(chunk, data.size());
+        chunk.insert(chunk.end(), data.begin(), data.end());
+    }
+
+    uint64_t offset = header.size() + 8 * size_t(blocks);
+    for (const std::vector<unsigned char>& chunk : chunks) {
+        put_u64(header, offset);
+        offset += chunk.size();
+    }
+    std::ofstream fout(filename, std::ios::binary);
+    fout.write(reinterpret_cast<const char*>(header.data()), header.size());
+    for (const std::vector<unsigned char>& chunk : chunks) {
+        fout.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    }
+    fout.close();
+}
+
+void put_u32_big_endian(std::vector<unsigned char>& out, uint32_t value) {
+    for (int shift = 24; shift >= 0; shift -= 8) {
+        out.push_back(value >> shift & 0xff);
+    }
+}
+
+uint32_t crc32(const unsigned char* data, size_t size, uint32_t crc = 0) {
+    static const std::vector<uint32_t> table = []() {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+// Length, type, data and CRC of a PNG chunk.
+void put_png_chunk(std::vector<unsigned char>& out, const char* type, const unsigned char* data, size_t size) {
+    put_u32_big_endian(out, size);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    out.insert(out.end(), data, data + size);
+    put_u32_big_endian(out, crc32(out.data() + start, size + 4));
+}
+
+unsigned char paeth(int a, int b, int c) {
+    int p = a + b - c;
+    int pa = std::abs(p - a);
+    int pb = std::abs(p - b);
+    int pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc) {
+        return a;
+    }
+    return pb <= pc ? b : c;
+}
+
+// Writes the filter type and the filtered bytes of row to out. above is
+// null for the first row.
+void png_filter_row(PngFilter filter, const unsigned char* row, const unsigned char* above, int size, unsigned char* out) {
+    out[0] = int(filter);
+    out += 1;
+    for (int i = 0; i < size; ++i) {
+        int a = i >= 3 ? row[i - 3] : 0;
+        int b = above ? above[i] : 0;
+        int c = above && i >= 3 ? above[i - 3] : 0;
+        int predicted = 0;
+        if (filter == PngFilter::Sub) {
+            predicted = a;
+        }
+        else if (filter == PngFilter::Up) {
+            predicted = b;
+        }
+        else if (filter == PngFilter::Average) {
+            predicted = (a + b) / 2;
+        }
+        else if (filter == PngFilter::Paeth) {
+            predicted = paeth(a, b, c);
+        }
+        out[i] = row[i] - predicted;
+    }
+}
+
+// Filtered rows first to last - 1, each with the filter whose output has
+// the smallest sum of absolute values as signed bytes if adaptive.
+void png_filter_rows(const ScenePixels& scene, PngFilter filter, int first, int last, std::vector<unsigned char>& out) {
+    int size = scene.width * 3;
+    out.resize(size_t(last - first) * (size + 1));
+    std::vector<unsigned char> candidate(size + 1);
+    for (int y = first; y < last; ++y) {
+        const unsigned char* row = reinterpret_cast<const unsigned char*>(&scene.pixels[size_t(y) * scene.width]);
+        const unsigned char* above = y > 0 ? row - size : nullptr;
+        unsigned char* filtered = &out[size_t(y - first) * (size + 1)];
+        if (filter != PngFilter::Adaptive) {
+            png_filter_row(filter, row, above, size, filtered);
+            continue;
+        }
+        long long best = -1;
+        for (int f = 0; f < 5; ++f) {
+            png_filter_row(PngFilter(f), row, above, size, candidate.data());
+            long long sum = 0;
+            for (int i = 1; i <= size; ++i) {
+                sum += std::abs(int(static_cast<signed char>(candidate[i])));
+            }
+            if (best < 0 || sum < best) {
+                best = sum;
+                std::copy(candidate.begin(), candidate.end(), filtered);
+            }
+        }
+    }
+}
+
+void write_png(std::string filename, const ScenePixels& scene, PngFilter filter, int threads) {
+    size_t row_bytes = size_t(scene.width) * 3 + 1;
+    int rows_per_part = std::max<size_t>(1, PNG_PART_BYTES / row_bytes);
+    int parts = std::max(1, (scene.height + rows_per_part - 1) / rows_per_part);
+    // Every part becomes one IDAT chunk. The first starts with the zlib
+    // header and only the last ends its deflate stream.
+    std::vector<std::vector<unsigned char>> chunks(parts);
+    std::vector<uint32_t> adlers(parts);
+    std::vector<size_t> sizes(parts);
+    std::atomic<int> next_part = 0;
+    auto compress_parts = [&]() {
+        std::vector<unsigned char> filtered;
+        for (int part = next_part++; part < parts; part = next_part++) {
+            int first = part * rows_per_part;
+            int last = std::min(scene.height, first + rows_per_part);
+            png_filter_rows(scene, filter, first, last, filtered);
+            std::vector<unsigned char> data;
+            if (part == 0) {
+                data = {0x78, 0x9c};
+            }
+            deflate_blocks(filtered.data(), filtered.size(), part + 1 == parts, data);
+            adlers[part] = adler32(filtered.data(), filtered.size());
+            sizes[part] = filtered.size();
+            put_png_chunk(chunks[part], "IDAT", data.data(), data.size());
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 0; t < std::min(threads, parts); ++t) {
+        workers.emplace_back(compress_parts);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    uint32_t adler = adlers[0];
+    for (int part = 1; part < parts; ++part) {
+        adler = adler32_combine(adler, adlers[part], sizes[part]);
+    }
+
+    std::vector<unsigned char> header = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    std::vector<unsigned char> ihdr;
+    put_u32_big_endian(ihdr, scene.width);
+    put_u32_big_endian(ihdr, scene.height);
+    // 8 bits per channel RGB, deflate, adaptive filtering, no interlacing.
+    ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0});
+    put_png_chunk(header, "IHDR", ihdr.data(), ihdr.size());
+    std::vector<unsigned char> end;
+    std::vector<unsigned char> checksum;
+    put_u32_big_endian(checksum, adler);
+    put_png_chunk(end, "IDAT", checksum.data(), checksum.size());
+    put_png_chunk(end, "IEND", nullptr, 0);
+    std::ofstream fout(filename, std::ios::binary);
+    fout.write(reinterpret_cast<const char*>(header.data()), header.size());
+    for (const std::vector<unsigned char>& chunk : chunks) {
+        fout.write(reinterpret_cast<const char*>(chunk.data()), chunk.size());
+    }
+    fout.write(reinterpret_cast<const char*>(end.data()), end.size());
+    fout.close();
+}
+
+void write_qoi(std::string filename, const ScenePixels& scene) {
+    std::vector<unsigned char> out = {'q', 'o', 'i', 'f'};
+    put_u32_big_endian(out, scene.width);
+    put_u32_big_endian(out, scene.height);
+    // RGB, sRGB with linear alpha.
+    out.push_back(3);
+    out.push_back(0);
+    out.reserve(out.size() + size_t(scene.width) * scene.height * 4 + 8);
+    // Recently seen pixels by hash, as RGB with the alpha of 255 implied.
+    // Entries not yet written hold transparent black for the decoder.
+    Color seen[64] = {};
+    bool written[64] = {};
+    Color previous(0, 0, 0);
+    int run = 0;
+    for (size_t i = 0; i < scene.pixels.size(); ++i) {
+        Color pixel = scene.pixels[i];
+        if (pixel.r == previous.r && pixel.g == previous.g && pixel.b == previous.b) {
+            ++run;
+            if (run == QOI_MAX_RUN || i + 1 == scene.pixels.size()) {
+                out.push_back(0xc0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out.push_back(0xc0 | (run - 1));
+            run = 0;
+        }
+        int index = (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + 255 * 11) % 64;
+        if (written[index] && seen[index].r == pixel.r && seen[index].g == pixel.g && seen[index].b == pixel.b) {
+            out.push_back(index);
+            previous = pixel;
+            continue;
+        }
+        seen[index] = pixel;
+        written[index] = true;
+        int dr = static_cast<signed char>(pixel.r - previous.r);
+        int dg = static_cast<signed char>(pixel.g - previous.g);
+        int db = static_cast<signed char>(pixel.b - previous.b);
+        int dr_dg = dr - dg;
+        int db_dg = db - dg;
+        if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+            out.push_back(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+        }
+        else if (dg >= -32 && dg <= 31 && dr_dg >= -8 && dr_dg <= 7 && db_dg >= -8 && db_dg <= 7) {
+            out.push_back(0x80 | (dg + 32));
+            out.push_back((dr_dg + 8) << 4 | (db_dg + 8));
+        }
+        else {
+            out.insert(out.end(), {0xfe, pixel.r, pixel.g, pixel.b});
+        }
+        previous = pixel;
+    }
+    out.insert(out.end(), {0, 0, 0, 0, 0, 0, 0, 1});
+    std::ofstream fout(filename, std::ios::binary);
+    fout.write(reinterpret_cast<const char*>(out.data()), out.size());
+    fout.close();
+}
+
+void write_aovs(std::string filename, const Framebuffer& frame) {
+    size_t dot = filename.find_last_of('.');
+    if (dot != std::string::npos && filename.find_first_of("/\\", dot) == std::string::npos) {
+        filename.erase(dot);
+    }
+    int n = frame.width * frame.height;
+    std::vector<glm::vec3> normal(n);
+    std::vector<float> object(n);
+    std::vector<float> samples(n);
+    for (int p = 0; p < n; ++p) {
+        float length = glm::length(frame.normal[p]);
+        normal[p] = length > 0 ? frame.normal[p] / length : glm::vec3(0.0);
+        object[p] = frame.object[p];
+        samples[p] = frame.samples[p];
+    }
+    write_pfm(filename + ".albedo.pfm", frame.width, frame.height, frame.albedo);
+    write_pfm(filename + ".normal.pfm", frame.width, frame.height, 3, reinterpret_cast<const float*>(normal.data()));
+    write_pfm(filename + ".depth.pfm", frame.width, frame.height, 1, frame.depth.data());
+    write_pfm(filename + ".object.pfm", frame.width, frame.height, 1, object.data());
+    write_pfm(filename + ".samples.pfm", frame.width, frame.height, 1, samples.data());
+}
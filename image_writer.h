@@ -1,6 +1,94 @@
 #include "structures.h"
 #include <string>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <atomic>
 
 #pragma once
 
-void write_ppm_pixels(std::string filename, ScenePixels scene);
\ No newline at end of file
+// Compression of the scanline blocks of an OpenEXR file: none, run-length
+// coding or zlib over blocks of 16 lines.
+enum class ExrCompression {None, Rle, Zip};
+// Filter applied to every row of a PNG before compression, or Adaptive to
+// choose one per row.
+enum class PngFilter {None, Sub, Up, Average, Paeth, Adaptive};
+
+// Settings of the writers that a scene can change.
+struct ImageOptions {
+    ExrCompression exr_compression = ExrCompression::Zip;
+    PngFilter png_filter = PngFilter::Adaptive;
+};
+
+// Writes a PPM row by row while the image is still being made, to standard
+// output if filename is "-". Rows may be finished in any order: a row is
+// written as soon as all rows above it are, until then it waits in a
+// reorder buffer. Only rows that have to wait are copied.
+struct PpmStream {
+    PpmStream(std::string filename, int width, int height);
+    // Safe to call from several threads.
+    void write_row(int y, const Color* row);
+
+private:
+    std::ofstream file;
+    std::ostream* out;
+    int width;
+    int height;
+    int next_row = 0;
+    std::map<int, std::vector<Color>> pending;
+    std::mutex mutex;
+};
+
+// PPM or PFM file created at its final size and mapped into memory, so the
+// rows are written straight to their place in the file by the threads that
+// render them. With sync_rows > 0 the mapping is flushed to the file every
+// sync_rows rows' worth of finished pixels, so partial results can be read
+// while rendering.
+struct MappedImage {
+    MappedImage(std::string filename, int width, int height, bool pfm, int sync_rows);
+    ~MappedImage();
+    // False if the file could not be created or mapped.
+    bool valid() const;
+    // Rows of a PPM are tone mapped, those of a PFM linear colors.
+    void write_row(int y, const Color* row);
+    void write_row(int y, const glm::vec3* row);
+    // Writes count pixels of row y from column x, for images rendered in
+    // tiles.
+    void write_span(int x, int y, int count, const Color* pixels);
+    void write_span(int x, int y, int count, const glm::vec3* pixels);
+
+private:
+    void pixels_finished(int count);
+
+    int fd = -1;
+    unsigned char* data = nullptr;
+    size_t size = 0;
+    size_t header_size = 0;
+    int width;
+    int height;
+    bool pfm;
+    int sync_rows;
+    std::atomic<size_t> finished_pixels = 0;
+};
+
+void write_ppm_pixels(std::string filename, const ScenePixels& scene);
+// Header of a portable float map, whose rows follow from the bottom up.
+void write_pfm_header(std::ostream& out, int width, int height, int channels);
+// Portable float map of channels 1 (grayscale) or 3 (RGB) floats per pixel,
+// given top row first.
+void write_pfm(std::string filename, int width, int height, int channels, const float* data);
+// RGB float map of colors kept as floats or halves, converted row by row.
+void write_pfm(std::string filename, int width, int height, const Vec3Buffer& colors);
+// Reads the colors of an RGB or grayscale PFM into frame. Returns false if
+// the file is not one.
+bool read_pfm(std::string filename, Framebuffer& frame);
+// Single-part scanline OpenEXR file with 32-bit float R, G and B channels.
+void write_exr(std::string filename, int width, int height, const glm::vec3* color, ExrCompression compression);
+// PNG of the pixels, whose rows are filtered and deflated in parts of about
+// a megabyte on several threads.
+void write_png(std::string filename, const ScenePixels& scene, PngFilter filter, int threads);
+// Quite OK Image format, 8-bit RGB.
+void write_qoi(std::string filename, const ScenePixels& scene);
+// Writes the albedo, normal, depth, object and sample count buffers of frame
+// as PFM files named after filename, e.g. out.albedo.pfm for out.ppm.
+void write_aovs(std::string filename, const Framebuffer& frame);
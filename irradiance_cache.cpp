@@ -0,0 +1,206 @@
+#include "irradiance_cache.h"
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include "random.h"
+
+// Spacing of the records as fractions of the scene size: every record
+// covers at least the smaller and at most the larger radius.
+const float IRRADIANCE_MIN_SPACING = 1e-3;
+const float IRRADIANCE_MAX_SPACING = 0.05;
+// Records lying this fraction of their radius in front of a point do not
+// contribute to it, they see a different part of the scene.
+const float IRRADIANCE_FRONT_TOLERANCE = 0.01;
+const int IRRADIANCE_MAX_DEPTH = 20;
+
+glm::vec3 irradiance_stratum_direction(glm::vec3 norm, int j, int k, glm::vec2 u) {
+    glm::vec3 t, b;
+    orthonormal_basis(norm, t, b);
+    float sin2_theta = (j + u.x) / IRRADIANCE_THETA_STRATA;
+    float sin_theta = std::sqrt(sin2_theta);
+    float cos_theta = std::sqrt(std::max(0.f, 1 - sin2_theta));
+    float phi = 2 * PI * (k + u.y) / IRRADIANCE_PHI_STRATA;
+    return t * (sin_theta * std::cos(phi)) + b * (sin_theta * std::sin(phi)) + norm * cos_theta;
+}
+
+IrradianceCache::IrradianceCache(glm::vec3 min, glm::vec3 max, float error, size_t max_bytes) {
+    this->error = error;
+    this->max_bytes = max_bytes;
+    float size = glm::length(max - min);
+    min_spacing = size * IRRADIANCE_MIN_SPACING;
+    max_spacing = size * IRRADIANCE_MAX_SPACING;
+    IrradianceNode root;
+    root.center = (min + max) / 2.f;
+    root.half_size = std::max(max.x - min.x, std::max(max.y - min.y, max.z - min.z)) / 2;
+    nodes.push_back(root);
+    bytes = sizeof(IrradianceNode);
+}
+
+bool IrradianceCache::lookup(glm::vec3 point, glm::vec3 norm, glm::vec3& irradiance) {
+    std::shared_lock lock(mutex);
+    glm::vec3 sum(0.0);
+    float weight_sum = 0;
+    int stack[8 * IRRADIANCE_MAX_DEPTH + 1];
+    int size = 0;
+    stack[size++] = 0;
+    while (size > 0) {
+        const IrradianceNode& node = nodes[stack[--size]];
+        for (int id : node.records) {
+            const IrradianceRecord& record = records[id];
+            glm::vec3 offset = point - record.position;
+            if (glm::dot(offset, norm + record.norm) < -2 * IRRADIANCE_FRONT_TOLERANCE * record.radius) {
+                continue;
+            }
+            float distance = glm::length(offset) / record.radius + std::sqrt(std::max(0.f, 1 - glm::dot(norm, record.norm)));
+            if (distance >= error) {
+                continue;
+            }
+            float weight = 1 / std::max(distance, 1e-6f);
+            glm::vec3 rotation = glm::cross(record.norm, norm);
+            for (int c = 0; c < 3; ++c) {
+                float value = record.irradiance[c] + glm::dot(rotation, record.rotation_gradient[c]) + glm::dot(offset, record.translation_gradient[c]);
+                sum[c] += weight * std::max(value, 0.f);
+            }
+            weight_sum += weight;
+        }
+        // A record lies in a node at least twice its radius wide, so it can
+        // only cover points within half a node of it.
+        for (int child : node.child) {
+            if (child >= 0 && glm::all(glm::lessThanEqual(glm::abs(point - nodes[child].center), glm::vec3(2 * nodes[child].half_size)))) {
+                stack[size++] = child;
+            }
+        }
+    }
+    if (weight_sum <= 0) {
+        return false;
+    }
+    irradiance = sum / weight_sum;
+    return true;
+}
+
+IrradianceRecord IrradianceCache::make_record(glm::vec3 point, glm::vec3 norm, const std::vector<glm::vec3>& radiance,
+                                              const std::vector<glm::vec3>& directions, const std::vector<float>& distance) const {
+    const int m = IRRADIANCE_THETA_STRATA;
+    const int n = IRRADIANCE_PHI_STRATA;
+    IrradianceRecord record;
+    record.position = point;
+    record.norm = norm;
+    glm::vec3 t, b;
+    orthonormal_basis(norm, t, b);
+    glm::vec3 sum(0.0);
+    float inverse_distance_sum = 0;
+    for (int c = 0; c < 3; ++c) {
+        record.rotation_gradient[c] = glm::vec3(0.0);
+        record.translation_gradient[c] = glm::vec3(0.0);
+    }
+    for (int j = 0; j < m; ++j) {
+        for (int k = 0; k < n; ++k) {
+            int index = j * n + k;
+            glm::vec3 l = radiance[index];
+            sum += l;
+            inverse_distance_sum += 1 / distance[index];
+
+            glm::vec3 d = directions[index];
+            float x = glm::dot(d, t);
+            float y = glm::dot(d, b);
+            float cos_theta = std::max(glm::dot(d, norm), 1e-4f);
+            float sin_theta = std::sqrt(x * x + y * y);
+            if (sin_theta > 0) {
+                glm::vec3 v = (b * x - t * y) / sin_theta;
+                for (int c = 0; c < 3; ++c) {
+                    record.rotation_gradient[c] += v * (l[c] * sin_theta / cos_theta);
+                }
+            }
+
+            // Changes in radiance across the stratum borders, weighted by how
+            // fast the borders move with the point.
+            float sin_lower = std::sqrt(float(j) / m);
+            float sin_upper = std::sqrt(float(j + 1) / m);
+            if (j > 0) {
+                float phi = 2 * PI * (k + 0.5f) / n;
+                glm::vec3 u_k = t * std::cos(phi) + b * std::sin(phi);
+                int below = index - n;
+                float r = std::min(distance[index], distance[below]);
+                glm::vec3 delta = l - radiance[below];
+                float scale = 2 * PI / n * sin_lower * (1 - float(j) / m) / r;
+                for (int c = 0; c < 3; ++c) {
+                    record.translation_gradient[c] += u_k * (scale * delta[c]);
+                }
+            }
+            float phi_lower = 2 * PI * k / n;
+            glm::vec3 v_k = b * std::cos(phi_lower) - t * std::sin(phi_lower);
+            int before = j * n + (k + n - 1) % n;
+            float r = std::min(distance[index], distance[before]);
+            glm::vec3 delta = l - radiance[before];
+            float scale = (sin_upper - sin_lower) / r;
+            for (int c = 0; c < 3; ++c) {
+                record.translation_gradient[c] += v_k * (scale * delta[c]);
+            }
+        }
+    }
+    record.irradiance = sum * (PI / (m * n));
+    for (int c = 0; c < 3; ++c) {
+        record.rotation_gradient[c] *= PI / (m * n);
+    }
+
+    float radius = inverse_distance_sum > 0 ? m * n / inverse_distance_sum : max_spacing;
+    // Bright gradients shrink the record so extrapolation stays bounded
+    // (Krivanek et al. 2006, "Making Radiance and Irradiance Caching Practical").
+    glm::vec3 luminance_weights(0.2126, 0.7152, 0.0722);
+    float luminance = glm::dot(record.irradiance, luminance_weights);
+    glm::vec3 luminance_gradient = record.translation_gradient[0] * luminance_weights.x + record.translation_gradient[1] * luminance_weights.y +
+                                   record.translation_gradient[2] * luminance_weights.z;
+    float gradient_length = glm::length(luminance_gradient);
+    if (gradient_length > 0) {
+        radius = std::min(radius, luminance / gradient_length);
+    }
+    record.radius = std::clamp(radius, min_spacing, max_spacing);
+    return record;
+}
+
+void IrradianceCache::insert(const IrradianceRecord& record) {
+    std::unique_lock lock(mutex);
+    if (is_full) {
+        return;
+    }
+    float coverage = error * record.radius;
+    int index = 0;
+    int depth = 0;
+    while (nodes[index].half_size / 2 >= coverage && depth < IRRADIANCE_MAX_DEPTH) {
+        const IrradianceNode& node = nodes[index];
+        glm::vec3 offset = record.position - node.center;
+        // Points outside the root stay there.
+        if (glm::any(glm::greaterThan(glm::abs(offset), glm::vec3(node.half_size)))) {
+            break;
+        }
+        int octant = (offset.x >= 0) + 2 * (offset.y >= 0) + 4 * (offset.z >= 0);
+        int child = node.child[octant];
+        if (child < 0) {
+            if (bytes + sizeof(IrradianceNode) > max_bytes) {
+                is_full = true;
+                return;
+            }
+            IrradianceNode created;
+            created.half_size = node.half_size / 2;
+            created.center = node.center + glm::vec3(octant & 1 ? 1 : -1, octant & 2 ? 1 : -1, octant & 4 ? 1 : -1) * created.half_size;
+            child = nodes.size();
+            nodes[index].child[octant] = child;
+            nodes.push_back(created);
+            bytes += sizeof(IrradianceNode);
+        }
+        index = child;
+        depth += 1;
+    }
+    if (bytes + sizeof(IrradianceRecord) + sizeof(int) > max_bytes) {
+        is_full = true;
+        return;
+    }
+    nodes[index].records.push_back(records.size());
+    records.push_back(record);
+    bytes += sizeof(IrradianceRecord) + sizeof(int);
+}
+
+size_t IrradianceCache::memory() {
+    std::shared_lock lock(mutex);
+    return bytes;
+}
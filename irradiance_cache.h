@@ -0,0 +1,70 @@
+#include <vector>
+#include <atomic>
+#include <shared_mutex>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+#pragma once
+
+// Irradiance caching (Ward et al. 1988, "A Ray Tracing Solution for Diffuse
+// Interreflection") with the translational and rotational gradients of Ward
+// and Heckbert 1992. Records of indirect irradiance are computed lazily by
+// gathering over a stratified hemisphere and are interpolated at nearby
+// points with similar normals.
+
+// Strata of the cosine-weighted hemisphere gathered for a record.
+const int IRRADIANCE_THETA_STRATA = 6;
+const int IRRADIANCE_PHI_STRATA = 18;
+
+struct IrradianceRecord {
+    glm::vec3 position;
+    glm::vec3 norm;
+    glm::vec3 irradiance;
+    // Harmonic mean distance to the surfaces seen from the record.
+    float radius;
+    // Gradients of every color channel.
+    glm::vec3 rotation_gradient[3];
+    glm::vec3 translation_gradient[3];
+};
+
+struct IrradianceNode {
+    glm::vec3 center;
+    float half_size;
+    int child[8] = {-1, -1, -1, -1, -1, -1, -1, -1};
+    std::vector<int> records;
+};
+
+// Direction of stratum (j, k) of the cosine-weighted hemisphere around norm,
+// jittered by u.
+glm::vec3 irradiance_stratum_direction(glm::vec3 norm, int j, int k, glm::vec2 u);
+
+// Safe to use from several threads: lookups share a lock, insertions take it
+// exclusively. Once the records reach the memory cap no more are inserted and
+// callers fall back to tracing the bounce.
+struct IrradianceCache {
+    // Larger values reuse records further away, Ward's a.
+    float error;
+    size_t max_bytes;
+    float min_spacing;
+    float max_spacing;
+
+    IrradianceCache(glm::vec3 min, glm::vec3 max, float error, size_t max_bytes);
+
+    bool lookup(glm::vec3 point, glm::vec3 norm, glm::vec3& irradiance);
+    // Builds a record from the incident radiance, direction and hit distance
+    // of every stratum, stored at index j * IRRADIANCE_PHI_STRATA + k.
+    IrradianceRecord make_record(glm::vec3 point, glm::vec3 norm, const std::vector<glm::vec3>& radiance,
+                                 const std::vector<glm::vec3>& directions, const std::vector<float>& distance) const;
+    void insert(const IrradianceRecord& record);
+    bool full() const {
+        return is_full;
+    }
+    size_t memory();
+
+    private:
+    std::vector<IrradianceRecord> records;
+    std::vector<IrradianceNode> nodes;
+    size_t bytes = 0;
+    std::atomic<bool> is_full = false;
+    std::shared_mutex mutex;
+};
@@ -0,0 +1,206 @@
+#include "light_bvh.h"
+#include <algorithm>
+#include <cmath>
+#include <glm/geometric.hpp>
+#include <glm/gtx/quaternion.hpp>
+
+// cos(max(0, a - b)) from the sines and cosines of a and b.
+float cos_sub_clamped(float sin_a, float cos_a, float sin_b, float cos_b) {
+    if (cos_a > cos_b) {
+        return 1;
+    }
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+float sin_from_cos(float c) {
+    return std::sqrt(std::max(0.f, 1 - c * c));
+}
+
+float LightBounds::importance(glm::vec3 point, glm::vec3 norm) const {
+    glm::vec3 center = (min + max) / 2.f;
+    float radius = glm::length(max - min) / 2;
+    float d2 = glm::dot(point - center, point - center);
+    if (d2 <= radius * radius) {
+        // Inside the bounding sphere every direction can reach a light.
+        return power / std::max(d2, radius * radius / 4);
+    }
+    glm::vec3 wi = (point - center) / std::sqrt(d2);
+
+    float sin2_b = radius * radius / d2;
+    float cos_b = std::sqrt(std::max(0.f, 1 - sin2_b));
+    float sin_b = std::sqrt(sin2_b);
+
+    float cos_w = glm::dot(axis, wi);
+    float sin_w = sin_from_cos(cos_w);
+    float sin_o = sin_from_cos(cos_theta_o);
+    float cos_wo = cos_sub_clamped(sin_w, cos_w, sin_o, cos_theta_o);
+    float cos_p = cos_sub_clamped(sin_from_cos(cos_wo), cos_wo, sin_b, cos_b);
+    if (cos_p <= cos_theta_e) {
+        return 0;
+    }
+
+    float cos_i = -glm::dot(wi, norm);
+    float cos_pi = cos_sub_clamped(sin_from_cos(cos_i), cos_i, sin_b, cos_b);
+    if (cos_pi <= 0) {
+        return 0;
+    }
+    return power * cos_p * cos_pi / d2;
+}
+
+LightBounds union_bounds(const LightBounds& a, const LightBounds& b) {
+    if (a.power == 0) {
+        return b;
+    }
+    if (b.power == 0) {
+        return a;
+    }
+    LightBounds result(glm::min(a.min, b.min), glm::max(a.max, b.max), a.power + b.power);
+    result.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+
+    // Smallest cone containing both normal cones.
+    float theta_a = std::acos(std::clamp(a.cos_theta_o, -1.f, 1.f));
+    float theta_b = std::acos(std::clamp(b.cos_theta_o, -1.f, 1.f));
+    float theta_d = std::acos(std::clamp(glm::dot(a.axis, b.axis), -1.f, 1.f));
+    if (std::min(theta_d + theta_b, 3.14159265f) <= theta_a) {
+        result.axis = a.axis;
+        result.cos_theta_o = a.cos_theta_o;
+        return result;
+    }
+    if (std::min(theta_d + theta_a, 3.14159265f) <= theta_b) {
+        result.axis = b.axis;
+        result.cos_theta_o = b.cos_theta_o;
+        return result;
+    }
+    float theta_o = (theta_a + theta_d + theta_b) / 2;
+    glm::vec3 rotation_axis = glm::cross(a.axis, b.axis);
+    if (theta_o >= 3.14159265f || glm::length(rotation_axis) == 0) {
+        result.cos_theta_o = -1;
+        return result;
+    }
+    result.axis = glm::angleAxis(theta_o - theta_a, glm::normalize(rotation_axis)) * a.axis;
+    result.cos_theta_o = std::cos(theta_o);
+    return result;
+}
+
+bool ray_crosses_box(glm::vec3 start, glm::vec3 inv_direction, glm::vec3 min, glm::vec3 max) {
+    glm::vec3 t1 = (min - start) * inv_direction;
+    glm::vec3 t2 = (max - start) * inv_direction;
+    glm::vec3 t_near = glm::min(t1, t2);
+    glm::vec3 t_far = glm::max(t1, t2);
+    float t_enter = std::max(t_near.x, std::max(t_near.y, t_near.z));
+    float t_exit = std::min(t_far.x, std::min(t_far.y, t_far.z));
+    return t_enter <= t_exit && t_exit >= 0;
+}
+
+LightBvh::LightBvh(const std::vector<LightBounds>& lights) {
+    if (lights.empty()) {
+        return;
+    }
+    std::vector<int> order(lights.size());
+    for (int i = 0; i < lights.size(); ++i) {
+        order[i] = i;
+    }
+    trails.assign(lights.size(), 0);
+    depths.assign(lights.size(), 0);
+    nodes.reserve(2 * lights.size());
+    build(order, lights, 0, lights.size(), 0, 0);
+}
+
+int LightBvh::build(std::vector<int>& order, const std::vector<LightBounds>& lights, int begin, int end, uint64_t trail, int depth) {
+    int index = nodes.size();
+    nodes.push_back(LightBvhNode());
+    if (end - begin == 1) {
+        nodes[index].bounds = lights[order[begin]];
+        nodes[index].light = order[begin];
+        trails[order[begin]] = trail;
+        depths[order[begin]] = depth;
+        return index;
+    }
+
+    glm::vec3 centroid_min = glm::vec3(INFINITY);
+    glm::vec3 centroid_max = glm::vec3(-INFINITY);
+    for (int i = begin; i < end; ++i) {
+        glm::vec3 c = (lights[order[i]].min + lights[order[i]].max) / 2.f;
+        centroid_min = glm::min(centroid_min, c);
+        centroid_max = glm::max(centroid_max, c);
+    }
+    glm::vec3 extent = centroid_max - centroid_min;
+    int axis = 0;
+    if (extent.y > extent.x) {
+        axis = 1;
+    }
+    if (extent.z > extent[axis]) {
+        axis = 2;
+    }
+    int mid = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end, [&](int a, int b) {
+        return lights[a].min[axis] + lights[a].max[axis] < lights[b].min[axis] + lights[b].max[axis];
+    });
+
+    int left = build(order, lights, begin, mid, trail, depth + 1);
+    int right = build(order, lights, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+    nodes[index].left = left;
+    nodes[index].right = right;
+    nodes[index].bounds = union_bounds(nodes[left].bounds, nodes[right].bounds);
+    return index;
+}
+
+bool LightBvh::child_probabilities(const LightBvhNode& node, glm::vec3 point, glm::vec3 norm, float& p_left) const {
+    float left = nodes[node.left].bounds.importance(point, norm);
+    float right = nodes[node.right].bounds.importance(point, norm);
+    if (left + right <= 0) {
+        return false;
+    }
+    p_left = left / (left + right);
+    return true;
+}
+
+float LightBvh::importance(glm::vec3 point, glm::vec3 norm) const {
+    if (nodes.empty()) {
+        return 0;
+    }
+    return nodes[0].bounds.importance(point, norm);
+}
+
+int LightBvh::sample(glm::vec3 point, glm::vec3 norm, float u, float& u_remapped, float& pmf) const {
+    pmf = 1;
+    int index = 0;
+    while (nodes[index].light < 0) {
+        float p_left;
+        if (!child_probabilities(nodes[index], point, norm, p_left)) {
+            return -1;
+        }
+        if (u < p_left) {
+            u = std::min(u / p_left, 0x1.fffffep-1f);
+            pmf *= p_left;
+            index = nodes[index].left;
+        }
+        else {
+            u = std::min((u - p_left) / (1 - p_left), 0x1.fffffep-1f);
+            pmf *= 1 - p_left;
+            index = nodes[index].right;
+        }
+    }
+    u_remapped = u;
+    return nodes[index].light;
+}
+
+float LightBvh::pmf(glm::vec3 point, glm::vec3 norm, int light) const {
+    float pmf = 1;
+    int index = 0;
+    for (int level = 0; level < depths[light]; ++level) {
+        float p_left;
+        if (!child_probabilities(nodes[index], point, norm, p_left)) {
+            return 0;
+        }
+        if (trails[light] & (uint64_t(1) << level)) {
+            pmf *= 1 - p_left;
+            index = nodes[index].right;
+        }
+        else {
+            pmf *= p_left;
+            index = nodes[index].left;
+        }
+    }
+    return pmf;
+}
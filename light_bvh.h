@@ -0,0 +1,95 @@
+#include <vector>
+#include <cstdint>
+#include <utility>
+#include <glm/vec3.hpp>
+
+#pragma once
+
+// Spatial and directional bounds of a set of emitters (Conty Estevez and
+// Kulla 2018, "Importance Sampling of Many Lights with Adaptive Tree
+// Splitting"). Normals lie within theta_o of axis, and each normal emits up
+// to theta_e past it. Closed diffuse emitters use the whole sphere.
+struct LightBounds {
+    glm::vec3 min;
+    glm::vec3 max;
+    float power = 0;
+    glm::vec3 axis = glm::vec3(0, 0, 1);
+    float cos_theta_o = -1;
+    float cos_theta_e = 0;
+
+    LightBounds() = default;
+    LightBounds(glm::vec3 min, glm::vec3 max, float power) : min(min), max(max), power(power) {}
+
+    // Estimated contribution to a receiver at point with normal norm.
+    float importance(glm::vec3 point, glm::vec3 norm) const;
+};
+
+LightBounds union_bounds(const LightBounds& a, const LightBounds& b);
+
+struct LightBvhNode {
+    LightBounds bounds;
+    int left = -1;
+    int right = -1;
+    int light = -1;
+};
+
+struct LightBvh {
+    std::vector<LightBvhNode> nodes;
+    // Path from the root to the leaf of every light, one bit per level.
+    std::vector<uint64_t> trails;
+    std::vector<int> depths;
+
+    LightBvh() {};
+    LightBvh(const std::vector<LightBounds>& lights);
+
+    bool empty() const {
+        return nodes.empty();
+    }
+    float importance(glm::vec3 point, glm::vec3 norm) const;
+    // Returns -1 if no light can contribute to the receiver.
+    int sample(glm::vec3 point, glm::vec3 norm, float u, float& u_remapped, float& pmf) const;
+    float pmf(glm::vec3 point, glm::vec3 norm, int light) const;
+
+    // Calls f(light, pmf) for every light whose bounds the ray crosses. Without
+    // use_importance the whole tree is visited and pmf is not computed.
+    template <typename F>
+    void for_each_crossed(glm::vec3 start, glm::vec3 direction, glm::vec3 point, glm::vec3 norm, bool use_importance, F f) const;
+
+    private:
+    int build(std::vector<int>& order, const std::vector<LightBounds>& lights, int begin, int end, uint64_t trail, int depth);
+    bool child_probabilities(const LightBvhNode& node, glm::vec3 point, glm::vec3 norm, float& p_left) const;
+};
+
+bool ray_crosses_box(glm::vec3 start, glm::vec3 inv_direction, glm::vec3 min, glm::vec3 max);
+
+template <typename F>
+void LightBvh::for_each_crossed(glm::vec3 start, glm::vec3 direction, glm::vec3 point, glm::vec3 norm, bool use_importance, F f) const {
+    if (nodes.empty()) {
+        return;
+    }
+    glm::vec3 inv_direction = 1.f / direction;
+    std::pair<int, float> stack[64];
+    int size = 0;
+    stack[size++] = {0, 1.f};
+    while (size > 0) {
+        auto [index, pmf] = stack[--size];
+        const LightBvhNode& node = nodes[index];
+        if (!ray_crosses_box(start, inv_direction, node.bounds.min, node.bounds.max)) {
+            continue;
+        }
+        if (node.light >= 0) {
+            f(node.light, pmf);
+            continue;
+        }
+        float p_left = 0.5;
+        if (use_importance && !child_probabilities(node, point, norm, p_left)) {
+            continue;
+        }
+        if (p_left > 0) {
+            stack[size++] = {node.left, pmf * p_left};
+        }
+        if (p_left < 1) {
+            stack[size++] = {node.right, pmf * (1 - p_left)};
+        }
+    }
+}
@@ -1,35 +1,490 @@
 #include <iostream>
 #include <string>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <mutex>
 #include "parser.h"
 #include "scene.h"
+#include "bdpt.h"
+#include "denoiser.h"
 #include "image_writer.h"
+#include "tiled_framebuffer.h"
+#include "tone_map.h"
 
-void fill_scene(Scene& scene, ScenePixels& result_scene) {
-    for (int i = 0; i < result_scene.width; ++i) {
-        for (int j = 0; j < result_scene.height; ++j) {
-            glm::vec3 result_color = glm::vec3(0.0);
-            for (int k = 0; k < scene.samples; ++k) {
-                Ray r = generate_ray(scene, i, j);
-                auto inter = intersection(r, scene, 0);
-                glm::vec3 col = inter.second;
-                if (std::isnan(col.x)) {
-                    col.x = 0;
-                }
-                if (std::isnan(col.y)) {
-                    col.y = 0;
+// Photons are emitted in chunks handed out to the threads until enough
+// caustic photons are stored, so at most one chunk per thread is stored
+// beyond the requested count. Emission also stops after a fixed number of
+// photons per requested one, for scenes where few of them find a caustic path.
+const int PHOTON_CHUNK = 4096;
+const int MAX_EMITTED_PER_PHOTON = 256;
+// Caustics are estimated from photons at most this fraction of the scene
+// size away.
+const float CAUSTIC_MAX_RADIUS = 0.01;
+
+// Bootstrap paths are handed out to the threads in chunks.
+const int MLT_BOOTSTRAP_CHUNK = 1024;
+const uint32_t MLT_SEED = 17;
+// Standard deviation of the small step mutations.
+const float MLT_SIGMA = 0.01;
+
+int thread_count() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+void build_caustic_map(Scene& scene) {
+    bool has_specular = false;
+    for (const Object& obj : scene.objects) {
+        has_specular = has_specular || obj.material != Material::Diffuse;
+    }
+    if (!has_specular || scene.dist.lights.empty()) {
+        return;
+    }
+    int threads = thread_count();
+    long long max_emitted = (long long)scene.caustic_photons * MAX_EMITTED_PER_PHOTON;
+    std::atomic<long long> next_photon = 0;
+    std::atomic<int> stored = 0;
+    std::vector<std::vector<Photon>> photons(threads);
+    std::vector<long long> emitted(threads, 0);
+    auto trace_photons = [&](int t) {
+        IndependentSampler sampler(7);
+        while (stored < scene.caustic_photons) {
+            long long begin = next_photon.fetch_add(PHOTON_CHUNK);
+            if (begin >= max_emitted) {
+                break;
+            }
+            size_t before = photons[t].size();
+            for (long long i = begin; i < begin + PHOTON_CHUNK; ++i) {
+                sampler.start_pixel_sample(i % PHOTON_CHUNK, i / PHOTON_CHUNK, 0);
+                trace_caustic_photon(scene, sampler, photons[t]);
+            }
+            emitted[t] += PHOTON_CHUNK;
+            stored += photons[t].size() - before;
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back(trace_photons, t);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+
+    long long total_emitted = 0;
+    for (int t = 0; t < threads; ++t) {
+        total_emitted += emitted[t];
+    }
+    std::vector<Photon> all_photons;
+    all_photons.reserve(stored);
+    for (int t = 0; t < threads; ++t) {
+        for (Photon& photon : photons[t]) {
+            photon.power /= float(total_emitted);
+            all_photons.push_back(photon);
+        }
+        photons[t] = std::vector<Photon>();
+    }
+    glm::vec3 min, max;
+    scene_bounds(scene, min, max);
+    scene.caustic_map = PhotonMap(std::move(all_photons), glm::length(max - min) * CAUSTIC_MAX_RADIUS);
+}
+
+// Learns the path guiding distribution in passes of 1, 2, 4, ... samples per
+// pixel, whose images are discarded.
+void train_guiding(Scene& scene) {
+    glm::vec3 min, max;
+    scene_bounds(scene, min, max);
+    scene.guide = GuidingField(min, max);
+    scene.guide.training = true;
+    for (int pass = 0; pass < scene.guiding_passes; ++pass) {
+        int samples = 1 << pass;
+        std::unique_ptr<Sampler> sampler = make_sampler(scene.sampler_type, 1000 + pass, samples);
+        for (int i = 0; i < scene.width; ++i) {
+            for (int j = 0; j < scene.height; ++j) {
+                for (int k = 0; k < samples; ++k) {
+                    sampler->start_pixel_sample(i, j, k);
+                    Ray r = generate_ray(scene, i, j, *sampler);
+                    intersection(r, scene, *sampler, 0);
                 }
-                if (std::isnan(col.z)) {
-                    col.z = 0;
+            }
+        }
+        scene.guide.refine(samples);
+    }
+    scene.guide.training = false;
+}
+
+float luminance(glm::vec3 col) {
+    return std::max(0.2126f * col.x + 0.7152f * col.y + 0.0722f * col.z, 0.f);
+}
+
+// Renders the pixel i, j of the image into the pixel p of frame.
+void render_pixel(Scene& scene, Sampler& sampler, int i, int j, Framebuffer& frame, int p) {
+    glm::vec3 result_color = glm::vec3(0.0);
+    glm::vec3 albedo(0.0);
+    glm::vec3 normal(0.0);
+    float depth = 0;
+    // Moments of the luminance divided by the albedo, whose noise the
+    // denoiser filters.
+    float sum = 0;
+    float sum2 = 0;
+    for (int k = 0; k < scene.samples; ++k) {
+        sampler.start_pixel_sample(i, j, k);
+        Ray r = generate_ray(scene, i, j, sampler);
+        glm::vec3 col;
+        FirstHit hit;
+        if (scene.integrator == Integrator::Bdpt) {
+            col = bdpt_radiance(r, scene, sampler, &hit);
+        }
+        else {
+            col = intersection(r, scene, sampler, 0, &hit).second;
+        }
+        if (std::isnan(col.x)) {
+            col.x = 0;
+        }
+        if (std::isnan(col.y)) {
+            col.y = 0;
+        }
+        if (std::isnan(col.z)) {
+            col.z = 0;
+        }
+        result_color += col;
+        float l = luminance(col);
+        if (hit.obj_id >= 0) {
+            if (frame.object[p] < 0) {
+                frame.object[p] = hit.obj_id;
+            }
+            glm::vec3 color = scene.objects[hit.obj_id].color;
+            albedo += color;
+            normal += hit.norm;
+            depth += hit.depth;
+            l /= std::max(luminance(color), 1e-3f);
+        }
+        sum += l;
+        sum2 += l * l;
+    }
+    float n = scene.samples;
+    frame.color.set(p, result_color / n);
+    frame.albedo.set(p, albedo / n);
+    frame.normal.set(p, normal / n);
+    frame.depth[p] = depth / n;
+    frame.samples[p] = scene.samples;
+    if (!frame.variance.empty()) {
+        float mean = sum / n;
+        frame.variance[p] = std::max(sum2 / n - mean * mean, 0.f) / (n - 1);
+    }
+}
+
+// Calls row_finished, if given, with every row once it is rendered.
+void fill_scene(Scene& scene, Framebuffer& frame, const std::function<void(int)>& row_finished) {
+    if (scene.samples > 1) {
+        frame.variance.assign(frame.width * frame.height, 0);
+    }
+    // Rows are handed out to the threads one at a time, top to bottom, so
+    // they are finished roughly in order. Samplers only depend on the pixel
+    // and sample index, so the image does not depend on the thread count.
+    std::atomic<int> next_row = 0;
+    auto render_rows = [&]() {
+        std::unique_ptr<Sampler> sampler = make_sampler(scene.sampler_type, 239, scene.samples);
+        for (int j = next_row++; j < frame.height; j = next_row++) {
+            for (int i = 0; i < frame.width; ++i) {
+                render_pixel(scene, *sampler, i, j, frame, i + j * frame.width);
+            }
+            if (row_finished) {
+                row_finished(j);
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 0; t < thread_count(); ++t) {
+        workers.emplace_back(render_rows);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
+
+// Renders the image tile by tile, handing every finished tile to store,
+// with only as many threads as there are tiles fitting into memory_budget
+// bytes. Returns false if a tile could not be stored.
+bool fill_scene_tiled(Scene& scene, const TileGrid& tiles, size_t memory_budget, const std::function<bool(int, const Framebuffer&)>& store) {
+    int tile_count = tiles.tiles_x * tiles.tiles_y;
+    Framebuffer largest(tiles.tile_size, tiles.tile_size);
+    if (scene.samples > 1) {
+        largest.variance.assign(tiles.tile_size * tiles.tile_size, 0);
+    }
+    int threads = std::clamp<size_t>(memory_budget / largest.memory(), 1, thread_count());
+    std::atomic<int> next_tile = 0;
+    std::atomic<bool> failed = false;
+    auto render_tiles = [&]() {
+        std::unique_ptr<Sampler> sampler = make_sampler(scene.sampler_type, 239, scene.samples);
+        for (int tile = next_tile++; tile < tile_count; tile = next_tile++) {
+            int x0, y0, x1, y1;
+            tiles.tile_bounds(tile, x0, y0, x1, y1);
+            Framebuffer frame(x1 - x0, y1 - y0);
+            if (scene.samples > 1) {
+                frame.variance.assign(frame.width * frame.height, 0);
+            }
+            for (int j = y0; j < y1; ++j) {
+                for (int i = x0; i < x1; ++i) {
+                    render_pixel(scene, *sampler, i, j, frame, (i - x0) + (j - y0) * frame.width);
                 }
-                result_color += col;
             }
-            result_color /= float(scene.samples);
-            Color converted_color = Color(convert_color(result_color.x), convert_color(result_color.y), convert_color(result_color.z));
-            result_scene.pixels[i + j * result_scene.width] = converted_color;
+            if (!store(tile, frame)) {
+                failed = true;
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back(render_tiles);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    return !failed;
+}
+
+// Path traced radiance of the path the sampler currently describes, whose
+// camera dimensions pick a point anywhere on the image.
+glm::vec3 mlt_radiance(Scene& scene, Sampler& sampler, int& pixel) {
+    glm::vec2 film = sampler.get_2d(DIM_CAMERA) * glm::vec2(scene.width, scene.height);
+    int x = std::min(int(film.x), scene.width - 1);
+    int y = std::min(int(film.y), scene.height - 1);
+    pixel = x + y * scene.width;
+    glm::vec3 col = intersection(generate_ray(scene, film), scene, sampler, 0).second;
+    for (int c = 0; c < 3; ++c) {
+        if (std::isnan(col[c])) {
+            col[c] = 0;
+        }
+    }
+    return col;
+}
+
+// Primary sample space Metropolis light transport (Kelemen et al. 2002).
+// Independent bootstrap paths estimate the mean luminance of the image and
+// seed one Markov chain per thread, chosen in proportion to luminance. The
+// chains mutate the primary samples of the path tracer and splat both the
+// proposed and the current path, weighted by the acceptance probability,
+// into a shared buffer. The guides come from one ray through the center of
+// every pixel, and the sample count of a pixel is the number of proposals
+// that landed in it.
+void fill_scene_mlt(Scene& scene, Framebuffer& frame) {
+    int threads = thread_count();
+    int bootstrap = scene.mlt_bootstrap;
+    std::vector<float> weights(bootstrap);
+    std::atomic<int> next_path = 0;
+    auto trace_bootstrap = [&]() {
+        PssSampler sampler(MLT_SEED, MLT_SIGMA, scene.mlt_large_step);
+        for (int begin = next_path.fetch_add(MLT_BOOTSTRAP_CHUNK); begin < bootstrap; begin = next_path.fetch_add(MLT_BOOTSTRAP_CHUNK)) {
+            for (int i = begin; i < std::min(begin + MLT_BOOTSTRAP_CHUNK, bootstrap); ++i) {
+                sampler.start_pixel_sample(0, 0, i);
+                int pixel;
+                weights[i] = luminance(mlt_radiance(scene, sampler, pixel));
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back(trace_bootstrap);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    double weight_sum = 0;
+    for (float w : weights) {
+        weight_sum += w;
+    }
+    if (weight_sum <= 0) {
+        return;
+    }
+    float brightness = weight_sum / bootstrap;
+    AliasTable chain_starts(weights);
+
+    int pixel_count = frame.width * frame.height;
+    std::vector<std::atomic<float>> splats(pixel_count * 3);
+    std::vector<std::atomic<int>> proposals(pixel_count);
+    auto splat = [&](int pixel, glm::vec3 value) {
+        for (int c = 0; c < 3; ++c) {
+            splats[pixel * 3 + c].fetch_add(value[c], std::memory_order_relaxed);
+        }
+    };
+    long long total_mutations = (long long)scene.samples * pixel_count;
+    auto run_chain = [&](int chain) {
+        long long mutations = total_mutations / threads + (chain < total_mutations % threads ? 1 : 0);
+        Pcg32 g(hash_combine(MLT_SEED, chain));
+        float u_remapped;
+        int start = chain_starts.sample(g.next_float(), u_remapped);
+        PssSampler sampler(MLT_SEED, MLT_SIGMA, scene.mlt_large_step);
+        sampler.start_pixel_sample(0, 0, start);
+        int pixel;
+        glm::vec3 current = mlt_radiance(scene, sampler, pixel);
+        float f_current = luminance(current);
+        for (long long m = 0; m < mutations; ++m) {
+            sampler.start_iteration();
+            int proposed_pixel;
+            glm::vec3 proposed = mlt_radiance(scene, sampler, proposed_pixel);
+            float f_proposed = luminance(proposed);
+            proposals[proposed_pixel].fetch_add(1, std::memory_order_relaxed);
+            float accept = f_current > 0 ? std::min(1.f, f_proposed / f_current) : 1;
+            if (accept > 0) {
+                splat(proposed_pixel, proposed * (accept / f_proposed));
+            }
+            if (accept < 1) {
+                splat(pixel, current * ((1 - accept) / f_current));
+            }
+            if (g.next_float() < accept) {
+                current = proposed;
+                f_current = f_proposed;
+                pixel = proposed_pixel;
+                sampler.accept();
+            }
+            else {
+                sampler.reject();
+            }
+        }
+    };
+    workers.clear();
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back(run_chain, t);
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    float scale = brightness / scene.samples;
+    for (int i = 0; i < pixel_count; ++i) {
+        frame.color.set(i, glm::vec3(splats[i * 3].load(), splats[i * 3 + 1].load(), splats[i * 3 + 2].load()) * scale);
+        frame.samples[i] = proposals[i].load();
+    }
+    for (int j = 0; j < frame.height; ++j) {
+        for (int i = 0; i < frame.width; ++i) {
+            Ray r = generate_ray(scene, glm::vec2(i + 0.5f, j + 0.5f));
+            std::optional<std::pair<int, Intersection>> hit = closest_intersection(r, scene);
+            if (hit.has_value()) {
+                int p = i + j * frame.width;
+                frame.object[p] = hit.value().first;
+                frame.albedo.set(p, scene.objects[hit.value().first].color);
+                frame.normal.set(p, hit.value().second.norm);
+                frame.depth[p] = hit.value().second.t;
+            }
         }
     }
 }
 
+void convert_frame(const Framebuffer& frame, ScenePixels& result_scene) {
+    tone_map(frame.color, result_scene.pixels.data(), frame.width, frame.height, thread_count());
+}
+
+// Reports the memory held by each buffer of the framebuffer.
+void report_memory(const Framebuffer& frame) {
+    std::pair<const char*, size_t> buffers[] = {
+        {"color", frame.color.memory()},
+        {"variance", frame.variance.size() * sizeof(float)},
+        {"albedo", frame.albedo.memory()},
+        {"normal", frame.normal.memory()},
+        {"depth", frame.depth.size() * sizeof(float)},
+        {"object", frame.object.size() * sizeof(int)},
+        {"samples", frame.samples.size() * sizeof(int)},
+    };
+    std::cerr << "framebuffer:";
+    for (auto& [name, bytes] : buffers) {
+        std::cerr << " " << name << " " << bytes / 1e6 << " MB,";
+    }
+    std::cerr << " total " << frame.memory() / 1e6 << " MB" << std::endl;
+}
+
+bool has_extension(const std::string& filename, const std::string& extension) {
+    return filename.size() >= extension.size() && filename.compare(filename.size() - extension.size(), extension.size(), extension) == 0;
+}
+
+bool is_ppm_output(const std::string& filename) {
+    for (const char* extension : {".pfm", ".exr", ".png", ".qoi"}) {
+        if (has_extension(filename, extension)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Reports the size of a written image and the time taken since begin.
+void report_write(const std::string& filename, int width, int height, std::chrono::steady_clock::time_point begin) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::error_code error;
+    uintmax_t bytes = std::filesystem::file_size(filename, error);
+    double megabytes = error ? 0 : bytes / 1e6;
+    double megapixels = double(width) * height / 1e6;
+    std::cerr << filename << ": " << megabytes << " MB in " << seconds << " s, " << megapixels / seconds << " Mpixel/s" << std::endl;
+}
+
+// The format follows the extension: PFM and OpenEXR keep the linear colors,
+// PNG, QOI and anything else, written as PPM, are tone mapped. The time
+// taken to encode and write the file is reported.
+void write_image(std::string filename, const Framebuffer& frame, const ImageOptions& options) {
+    auto begin = std::chrono::steady_clock::now();
+    if (has_extension(filename, ".pfm")) {
+        write_pfm(filename, frame.width, frame.height, frame.color);
+    }
+    else if (has_extension(filename, ".exr")) {
+        std::vector<glm::vec3> colors;
+        write_exr(filename, frame.width, frame.height, frame.color.float_data(colors), options.exr_compression);
+    }
+    else {
+        ScenePixels result_scene = ScenePixels(frame.width, frame.height, std::vector<Color>(frame.width * frame.height));
+        convert_frame(frame, result_scene);
+        if (has_extension(filename, ".png")) {
+            write_png(filename, result_scene, options.png_filter, thread_count());
+        }
+        else if (has_extension(filename, ".qoi")) {
+            write_qoi(filename, result_scene);
+        }
+        else {
+            write_ppm_pixels(filename, result_scene);
+        }
+    }
+    report_write(filename, frame.width, frame.height, begin);
+}
+
+// Writes the image assembled from tiles. PPM and PFM are written one row
+// at a time, other formats need the whole image in memory.
+bool write_tiled_image(std::string filename, const TiledFramebuffer& tiles, const ImageOptions& options) {
+    auto begin = std::chrono::steady_clock::now();
+    if (has_extension(filename, ".pfm")) {
+        std::ofstream fout(filename, std::ios::binary);
+        write_pfm_header(fout, tiles.width, tiles.height, 3);
+        bool assembled = tiles.assemble(true, [&](int, const glm::vec3* row) {
+            fout.write(reinterpret_cast<const char*>(row), sizeof(glm::vec3) * tiles.width);
+        });
+        fout.close();
+        if (assembled) {
+            report_write(filename, tiles.width, tiles.height, begin);
+        }
+        return assembled;
+    }
+    if (is_ppm_output(filename)) {
+        PpmStream stream(filename, tiles.width, tiles.height);
+        std::vector<Color> converted(tiles.width);
+        bool assembled = tiles.assemble(false, [&](int y, const glm::vec3* row) {
+            tone_map_row(row, converted.data(), tiles.width);
+            stream.write_row(y, converted.data());
+        });
+        if (assembled) {
+            report_write(filename, tiles.width, tiles.height, begin);
+        }
+        return assembled;
+    }
+    Framebuffer frame;
+    frame.width = tiles.width;
+    frame.height = tiles.height;
+    frame.color = Vec3Buffer(size_t(tiles.width) * tiles.height, false);
+    bool assembled = tiles.assemble(false, [&](int y, const glm::vec3* row) {
+        frame.color.write(size_t(y) * tiles.width, tiles.width, row);
+    });
+    if (assembled) {
+        write_image(filename, frame, options);
+    }
+    return assembled;
+}
+
 int main(int argc, char** argv) {
     if (argc != 3) {
         std::cerr << "Wrong number of arguments" << std::endl;
@@ -37,9 +492,144 @@ int main(int argc, char** argv) {
     }
     std::string from_filename = argv[1];
     std::string to_filename = argv[2];
+    // A PFM input is an earlier render, which is only converted to the
+    // output format.
+    if (has_extension(from_filename, ".pfm")) {
+        Framebuffer frame;
+        if (!read_pfm(from_filename, frame)) {
+            std::cerr << "Cannot read " << from_filename << std::endl;
+            return -1;
+        }
+        write_image(to_filename, frame, ImageOptions());
+        return 0;
+    }
     Scene scene = parse(from_filename);
-    ScenePixels result_scene = ScenePixels(scene.width, scene.height, std::vector<Color>(scene.width * scene.height));
-    fill_scene(scene, result_scene);
-    write_ppm_pixels(to_filename, result_scene);
+    bool path_tracing = scene.integrator == Integrator::Path;
+    if (path_tracing && scene.caustic_photons > 0) {
+        build_caustic_map(scene);
+    }
+    if (path_tracing && scene.guiding_passes > 0) {
+        train_guiding(scene);
+    }
+    if (path_tracing && scene.irradiance_error > 0) {
+        glm::vec3 min, max;
+        scene_bounds(scene, min, max);
+        scene.irradiance_cache = std::make_unique<IrradianceCache>(min, max, scene.irradiance_error, size_t(scene.irradiance_memory_mb) << 20);
+    }
+    // Tiles spilled to disk keep only the tiles being rendered in memory.
+    // MLT and the denoiser need the whole image, and AOVs are not spilled.
+    if (scene.tile_size > 0 && scene.integrator != Integrator::Mlt && scene.denoise_iterations == 0) {
+        if (scene.write_aovs) {
+            std::cerr << "AOVs are not written for tiled renders" << std::endl;
+        }
+        size_t memory_budget = size_t(scene.tile_memory_mb) << 20;
+        bool pfm = has_extension(to_filename, ".pfm");
+        // A mapped output is written tile by tile in place, without a
+        // spill file.
+        if (scene.mapped_output && to_filename != "-" && (pfm || is_ppm_output(to_filename))) {
+            MappedImage image(to_filename, scene.width, scene.height, pfm, scene.sync_rows);
+            if (!image.valid()) {
+                std::cerr << "Cannot map " << to_filename << std::endl;
+                return -1;
+            }
+            TileGrid tiles(scene.width, scene.height, scene.tile_size);
+            auto begin = std::chrono::steady_clock::now();
+            fill_scene_tiled(scene, tiles, memory_budget, [&](int tile, const Framebuffer& frame) {
+                int x0, y0, x1, y1;
+                tiles.tile_bounds(tile, x0, y0, x1, y1);
+                std::vector<glm::vec3> colors(frame.width);
+                std::vector<Color> row(frame.width);
+                for (int y = 0; y < frame.height; ++y) {
+                    frame.color.read(size_t(y) * frame.width, frame.width, colors.data());
+                    if (pfm) {
+                        image.write_span(x0, y0 + y, frame.width, colors.data());
+                    }
+                    else {
+                        tone_map_row(colors.data(), row.data(), frame.width);
+                        image.write_span(x0, y0 + y, frame.width, row.data());
+                    }
+                }
+                return true;
+            });
+            report_write(to_filename, scene.width, scene.height, begin);
+            return 0;
+        }
+        TiledFramebuffer tiles(to_filename + ".tiles", scene.width, scene.height, scene.tile_size);
+        auto spill = [&](int tile, const Framebuffer& frame) {
+            return tiles.write_tile(tile, frame);
+        };
+        if (!tiles.valid() || !fill_scene_tiled(scene, tiles, memory_budget, spill) || !write_tiled_image(to_filename, tiles, scene.image_options)) {
+            std::cerr << "Cannot write the tiles of " << to_filename << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+    Framebuffer frame(scene.width, scene.height, scene.half_framebuffer);
+    // A PPM or PFM that needs no pass over the whole image after rendering
+    // is written while the rows are finished, in place in a mapped file or
+    // as a stream.
+    bool by_rows = scene.integrator != Integrator::Mlt && scene.denoise_iterations == 0;
+    bool pfm = has_extension(to_filename, ".pfm");
+    bool mapped = by_rows && scene.mapped_output && to_filename != "-" && (pfm || is_ppm_output(to_filename));
+    bool streaming = by_rows && !mapped && is_ppm_output(to_filename);
+    // Images written while rendering are timed from their first row.
+    std::once_flag first_row;
+    std::chrono::steady_clock::time_point write_begin;
+    auto start_writing = [&]() {
+        std::call_once(first_row, [&]() {
+            write_begin = std::chrono::steady_clock::now();
+        });
+    };
+    if (scene.integrator == Integrator::Mlt) {
+        fill_scene_mlt(scene, frame);
+    }
+    else if (mapped) {
+        MappedImage image(to_filename, frame.width, frame.height, pfm, scene.sync_rows);
+        if (!image.valid()) {
+            std::cerr << "Cannot map " << to_filename << std::endl;
+            return -1;
+        }
+        fill_scene(scene, frame, [&](int y) {
+            start_writing();
+            std::vector<glm::vec3> colors(frame.width);
+            frame.color.read(size_t(y) * frame.width, frame.width, colors.data());
+            if (pfm) {
+                image.write_row(y, colors.data());
+                return;
+            }
+            std::vector<Color> row(frame.width);
+            tone_map_row(colors.data(), row.data(), frame.width);
+            image.write_row(y, row.data());
+        });
+        report_write(to_filename, frame.width, frame.height, write_begin);
+    }
+    else if (streaming) {
+        PpmStream stream(to_filename, frame.width, frame.height);
+        fill_scene(scene, frame, [&](int y) {
+            start_writing();
+            std::vector<glm::vec3> colors(frame.width);
+            frame.color.read(size_t(y) * frame.width, frame.width, colors.data());
+            std::vector<Color> row(frame.width);
+            tone_map_row(colors.data(), row.data(), frame.width);
+            stream.write_row(y, row.data());
+        });
+        report_write(to_filename, frame.width, frame.height, write_begin);
+    }
+    else {
+        fill_scene(scene, frame, nullptr);
+    }
+    report_memory(frame);
+    if (scene.write_aovs && to_filename == "-") {
+        std::cerr << "AOVs are not written for output to stdout" << std::endl;
+    }
+    else if (scene.write_aovs) {
+        write_aovs(to_filename, frame);
+    }
+    if (scene.denoise_iterations > 0) {
+        denoise(frame, scene.denoise_iterations, thread_count());
+    }
+    if (!mapped && !streaming) {
+        write_image(to_filename, frame, scene.image_options);
+    }
     return 0;
 }
\ No newline at end of file
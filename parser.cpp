@@ -7,6 +7,7 @@
 Scene parse(std::string filename) {
     std::ifstream fin(filename);
     Scene scene;
+    LightSelection light_selection = LightSelection::Bvh;
     std::string line;
     while (std::getline(fin, line)) {
         std::stringstream sin(line);
@@ -100,18 +101,150 @@ Scene parse(std::string filename) {
         else if (command == "RAY_DEPTH") {
             sin >> scene.recursion_depth;
         }
+        else if (command == "ROULETTE_DEPTH") {
+            sin >> scene.roulette_depth;
+        }
+        else if (command == "SAMPLER") {
+            std::string type;
+            sin >> type;
+            if (type == "SOBOL") {
+                scene.sampler_type = SamplerType::Sobol;
+            }
+            else if (type == "BLUE_NOISE") {
+                scene.sampler_type = SamplerType::BlueNoise;
+            }
+            else {
+                scene.sampler_type = SamplerType::Independent;
+            }
+        }
+        else if (command == "LIGHT_SELECTION") {
+            std::string type;
+            sin >> type;
+            if (type == "POWER") {
+                light_selection = LightSelection::Power;
+            }
+            else {
+                light_selection = LightSelection::Bvh;
+            }
+        }
+        else if (command == "INTEGRATOR") {
+            std::string type;
+            sin >> type;
+            if (type == "BDPT") {
+                scene.integrator = Integrator::Bdpt;
+            }
+            else if (type == "MLT") {
+                scene.integrator = Integrator::Mlt;
+                int bootstrap;
+                if (sin >> bootstrap) {
+                    scene.mlt_bootstrap = std::max(bootstrap, 1);
+                    sin >> scene.mlt_large_step;
+                }
+            }
+            else {
+                scene.integrator = Integrator::Path;
+            }
+        }
+        else if (command == "DENOISE") {
+            scene.denoise_iterations = 5;
+            int iterations;
+            if (sin >> iterations) {
+                scene.denoise_iterations = std::max(iterations, 0);
+            }
+        }
+        else if (command == "EXR_COMPRESSION") {
+            std::string type;
+            sin >> type;
+            if (type == "NONE") {
+                scene.image_options.exr_compression = ExrCompression::None;
+            }
+            else if (type == "RLE") {
+                scene.image_options.exr_compression = ExrCompression::Rle;
+            }
+            else {
+                scene.image_options.exr_compression = ExrCompression::Zip;
+            }
+        }
+        else if (command == "PNG_FILTER") {
+            std::string type;
+            sin >> type;
+            const std::string names[5] = {"NONE", "SUB", "UP", "AVERAGE", "PAETH"};
+            scene.image_options.png_filter = PngFilter::Adaptive;
+            for (int i = 0; i < 5; ++i) {
+                if (type == names[i]) {
+                    scene.image_options.png_filter = PngFilter(i);
+                }
+            }
+        }
+        else if (command == "MAPPED_OUTPUT") {
+            scene.mapped_output = true;
+            int rows;
+            if (sin >> rows) {
+                scene.sync_rows = std::max(rows, 0);
+            }
+        }
+        else if (command == "TILED_FRAMEBUFFER") {
+            scene.tile_size = 64;
+            int size;
+            if (sin >> size) {
+                scene.tile_size = std::max(size, 1);
+                int memory_mb;
+                if (sin >> memory_mb) {
+                    scene.tile_memory_mb = std::max(memory_mb, 1);
+                }
+            }
+        }
+        else if (command == "HALF_FRAMEBUFFER") {
+            scene.half_framebuffer = true;
+        }
+        else if (command == "AOVS") {
+            scene.write_aovs = true;
+        }
+        else if (command == "DIRECT_LIGHTING") {
+            std::string type;
+            sin >> type;
+            if (type == "RIS") {
+                scene.direct_lighting = DirectLighting::Ris;
+                int candidates;
+                if (sin >> candidates) {
+                    scene.ris_candidates = std::max(candidates, 1);
+                }
+            }
+            else {
+                scene.direct_lighting = DirectLighting::Nee;
+            }
+        }
+        else if (command == "GUIDING") {
+            sin >> scene.guiding_passes;
+        }
+        else if (command == "CAUSTIC_PHOTONS") {
+            sin >> scene.caustic_photons;
+            int neighbours;
+            if (sin >> neighbours) {
+                scene.caustic_neighbours = std::max(neighbours, 1);
+            }
+        }
+        else if (command == "IRRADIANCE_CACHE") {
+            sin >> scene.irradiance_error;
+            int memory_mb;
+            if (sin >> memory_mb) {
+                scene.irradiance_memory_mb = memory_mb;
+            }
+        }
         else if (command == "SAMPLES") {
             sin >> scene.samples;
         }
     }
-    scene.dist = MixDistribution(CosineDistribution(42), 32);
+    scene.dist = MixDistribution(CosineDistribution());
+    scene.dist.selection = light_selection;
     for (int i = 0; i < scene.objects.size(); ++i) {
         if (scene.objects[i].emission != glm::vec3(0.0)) {
             if (Plane* pval = std::get_if<Plane>(&scene.objects[i].shape)) {
                 continue;
             }
-            scene.dist.add_light(LightDistribution(44 + i, scene.objects[i]));
+            scene.dist.add_light(LightDistribution(scene.objects[i], i));
         }
     }
+    scene.dist.build_light_table();
     return scene;
 }
\ No newline at end of file
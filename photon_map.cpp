@@ -0,0 +1,97 @@
+#include "photon_map.h"
+#include <algorithm>
+#include <utility>
+#include <glm/geometric.hpp>
+#include "random.h"
+
+PhotonMap::PhotonMap(std::vector<Photon> photons, float max_radius) {
+    this->photons = std::move(photons);
+    this->max_radius = max_radius;
+    build(0, this->photons.size());
+}
+
+void PhotonMap::build(int begin, int end) {
+    if (end - begin <= 0) {
+        return;
+    }
+    glm::vec3 min = photons[begin].position;
+    glm::vec3 max = min;
+    for (int i = begin + 1; i < end; ++i) {
+        min = glm::min(min, photons[i].position);
+        max = glm::max(max, photons[i].position);
+    }
+    glm::vec3 extent = max - min;
+    int axis = 0;
+    if (extent.y > extent.x) {
+        axis = 1;
+    }
+    if (extent.z > extent[axis]) {
+        axis = 2;
+    }
+    int mid = (begin + end) / 2;
+    std::nth_element(photons.begin() + begin, photons.begin() + mid, photons.begin() + end, [axis](const Photon& a, const Photon& b) {
+        return a.position[axis] < b.position[axis];
+    });
+    photons[mid].axis = axis;
+    build(begin, mid);
+    build(mid + 1, end);
+}
+
+glm::vec3 PhotonMap::irradiance(glm::vec3 point, glm::vec3 norm, int neighbours) const {
+    if (photons.empty()) {
+        return glm::vec3(0.0);
+    }
+    // Max-heap of the squared distances of the nearest photons found so far.
+    std::vector<std::pair<float, int>> nearest;
+    nearest.reserve(neighbours + 1);
+    float radius2 = max_radius * max_radius;
+    // Ranges still to search, with the squared distance to their side of
+    // the splitting plane.
+    struct Range {
+        int begin;
+        int end;
+        float distance2;
+    };
+    Range stack[64];
+    int size = 0;
+    stack[size++] = {0, int(photons.size()), 0};
+    while (size > 0) {
+        auto [begin, end, plane_distance2] = stack[--size];
+        if (end <= begin || plane_distance2 >= radius2) {
+            continue;
+        }
+        int mid = (begin + end) / 2;
+        const Photon& photon = photons[mid];
+        glm::vec3 offset = point - photon.position;
+        float distance2 = glm::dot(offset, offset);
+        if (distance2 < radius2) {
+            nearest.push_back({distance2, mid});
+            std::push_heap(nearest.begin(), nearest.end());
+            if (nearest.size() > neighbours) {
+                std::pop_heap(nearest.begin(), nearest.end());
+                nearest.pop_back();
+            }
+            if (nearest.size() == neighbours) {
+                radius2 = nearest.front().first;
+            }
+        }
+        // The far side is pushed first, so the near side is searched first
+        // and shrinks the radius before the far side is reached.
+        float split = offset[photon.axis];
+        Range near = {begin, mid, 0};
+        Range far = {mid + 1, end, split * split};
+        if (split > 0) {
+            std::swap(near.begin, far.begin);
+            std::swap(near.end, far.end);
+        }
+        stack[size++] = far;
+        stack[size++] = near;
+    }
+    glm::vec3 power(0.0);
+    for (auto [distance2, index] : nearest) {
+        if (glm::dot(photons[index].direction, norm) < 0) {
+            power += photons[index].power;
+        }
+    }
+    return power / (PI * radius2);
+}
@@ -0,0 +1,35 @@
+#include <vector>
+#include <glm/vec3.hpp>
+
+#pragma once
+
+// Caustic photon map (Jensen 1996, "Global Illumination using Photon Maps").
+// Photons that reached a diffuse surface through specular or dielectric
+// objects are kept in a balanced kd-tree stored implicitly in one array: the
+// median of every range is the node splitting it.
+
+struct Photon {
+    glm::vec3 position;
+    // Direction the photon was travelling in.
+    glm::vec3 direction;
+    glm::vec3 power;
+    int axis;
+};
+
+struct PhotonMap {
+    std::vector<Photon> photons;
+    float max_radius = 0;
+
+    PhotonMap() {};
+    PhotonMap(std::vector<Photon> photons, float max_radius);
+
+    bool empty() const {
+        return photons.empty();
+    }
+    // Density of the power arriving at a surface with normal norm from the
+    // given number of photons nearest to point, at most max_radius away.
+    glm::vec3 irradiance(glm::vec3 point, glm::vec3 norm, int neighbours) const;
+
+    private:
+    void build(int begin, int end);
+};
@@ -0,0 +1,82 @@
+#include <cstdint>
+#include <cmath>
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <glm/geometric.hpp>
+
+#pragma once
+
+const float PI = 3.14159265f;
+
+// PCG32 (XSH-RR) generator, see pcg-random.org. Returns floats in [0, 1).
+struct Pcg32 {
+    uint64_t state;
+    uint64_t inc;
+
+    Pcg32() : Pcg32(0x853c49e6748fea9bULL) {}
+    Pcg32(uint64_t seed, uint64_t stream = 0xda3e39cb94b95bdbULL) {
+        state = 0;
+        inc = (stream << 1u) | 1u;
+        next_uint();
+        state += seed;
+        next_uint();
+    }
+
+    uint32_t next_uint() {
+        uint64_t old_state = state;
+        state = old_state * 6364136223846793005ULL + inc;
+        uint32_t xorshifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+        uint32_t rot = uint32_t(old_state >> 59u);
+        return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
+    }
+
+    float next_float() {
+        return float(next_uint() >> 8) * 0x1p-24f;
+    }
+
+    float uniform(float a, float b) {
+        return a + (b - a) * next_float();
+    }
+};
+
+// Duff et al. 2017, "Building an Orthonormal Basis, Revisited".
+inline void orthonormal_basis(glm::vec3 n, glm::vec3& t, glm::vec3& b) {
+    float sign = std::copysign(1.0f, n.z);
+    float a = -1.0f / (sign + n.z);
+    float c = n.x * n.y * a;
+    t = glm::vec3(1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x);
+    b = glm::vec3(c, sign + n.y * n.y * a, -n.y);
+}
+
+inline glm::vec2 sample_concentric_disk(float u1, float u2) {
+    float x = 2 * u1 - 1;
+    float y = 2 * u2 - 1;
+    if (x == 0 && y == 0) {
+        return glm::vec2(0.0);
+    }
+    float r, theta;
+    if (std::abs(x) > std::abs(y)) {
+        r = x;
+        theta = PI / 4 * (y / x);
+    }
+    else {
+        r = y;
+        theta = PI / 2 - PI / 4 * (x / y);
+    }
+    return r * glm::vec2(std::cos(theta), std::sin(theta));
+}
+
+inline glm::vec3 sample_cosine_hemisphere(glm::vec3 norm, float u1, float u2) {
+    glm::vec2 d = sample_concentric_disk(u1, u2);
+    float z = std::sqrt(std::max(0.0f, 1 - d.x * d.x - d.y * d.y));
+    glm::vec3 t, b;
+    orthonormal_basis(norm, t, b);
+    return d.x * t + d.y * b + z * norm;
+}
+
+inline glm::vec3 sample_uniform_sphere(float u1, float u2) {
+    float z = 1 - 2 * u1;
+    float r = std::sqrt(std::max(0.0f, 1 - z * z));
+    float phi = 2 * PI * u2;
+    return glm::vec3(r * std::cos(phi), r * std::sin(phi), z);
+}
@@ -2,50 +2,175 @@
 #include <math.h>
 #include <algorithm>
 #include <iostream>
+#include <bit>
 
-float aces_tone_map(float component) {
-    const float a = 2.51f;
-    const float b = 0.03f;
-    const float c = 2.43f;
-    const float d = 0.59f;
-    const float e = 0.14f;
-    float color = (component * (a * component + b)) / (component * (c * component + d) + e);
-    return glm::clamp(color, 0.f, 1.f);
+glm::vec3 emitted(const Object& obj, Intersection inter) {
+    if (inter.is_inside && obj.material != Material::Metallic) {
+        return glm::vec3(0.0);
+    }
+    return obj.emission;
+}
+
+float power_heuristic(float pdf_a, float pdf_b) {
+    float a = pdf_a * pdf_a;
+    float b = pdf_b * pdf_b;
+    if (a + b == 0) {
+        return 0;
+    }
+    return a / (a + b);
+}
+
+glm::vec3 sample_direct_light(Scene& scene, int obj_id, glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim, bool mis) {
+    const float eps = 1e-4;
+    if (scene.dist.lights.size() == 0) {
+        return glm::vec3(0.0);
+    }
+    int light_id;
+    glm::vec3 d = scene.dist.sample_light(point, norm, sampler, dim, light_id);
+    float cosine = glm::dot(norm, d);
+    if (light_id < 0 || cosine <= 0) {
+        return glm::vec3(0.0);
+    }
+    std::optional<std::pair<int, Intersection>> hit = closest_intersection(Ray(point + norm * eps, d), scene);
+    if (!hit.has_value() || hit.value().first != scene.dist.lights[light_id].obj_id) {
+        return glm::vec3(0.0);
+    }
+    glm::vec3 light_emission = emitted(scene.objects[hit.value().first], hit.value().second);
+    float light_pdf = scene.dist.light_pdf(point, norm, d, light_id);
+    if (light_pdf <= 0 || light_emission == glm::vec3(0.0)) {
+        return glm::vec3(0.0);
+    }
+    float weight = 1;
+    if (mis) {
+        weight = power_heuristic(light_pdf, bounce_pdf(scene, point, norm, d));
+    }
+    return scene.objects[obj_id].color / 3.14f * light_emission * cosine / light_pdf * weight;
+}
+
+// Resampled importance sampling (Talbot et al. 2005) with a streaming
+// reservoir, as in Bitterli et al. 2020, "Spatiotemporal Reservoir
+// Resampling for Real-Time Ray Tracing with Dynamic Direct Lighting".
+// Candidates come from the regular light sampler and are weighted by their
+// unshadowed contribution; only the kept one is tested for occlusion.
+glm::vec3 sample_direct_light_ris(Scene& scene, int obj_id, glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim) {
+    const float eps = 1e-4;
+    if (scene.dist.lights.size() == 0) {
+        return glm::vec3(0.0);
+    }
+    int candidates = scene.ris_candidates;
+    float u_select = sampler.get_1d(dim + DIM_LIGHT_SELECT);
+    glm::vec2 u_position = sampler.get_2d(dim + DIM_LIGHT_POSITION);
+    float u_reservoir = sampler.get_1d(dim + DIM_LIGHT_RESERVOIR);
+
+    float weight_sum = 0;
+    int chosen_light = -1;
+    glm::vec3 chosen_d;
+    float chosen_target = 0;
+    for (int k = 0; k < candidates; ++k) {
+        // Shifting one sample along a rank-1 lattice keeps the candidates stratified.
+        float u_k = u_select + float(k) / candidates;
+        glm::vec2 u_position_k = u_position + glm::vec2(0.7548777f, 0.5698403f) * float(k);
+        u_k -= std::floor(u_k);
+        u_position_k -= glm::floor(u_position_k);
+
+        int light_id;
+        glm::vec3 d = scene.dist.sample_light(point, norm, u_k, u_position_k, light_id);
+        float cosine = glm::dot(norm, d);
+        if (light_id < 0 || cosine <= 0) {
+            continue;
+        }
+        float source_pdf = scene.dist.light_pdf(point, norm, d, light_id);
+        if (source_pdf <= 0) {
+            continue;
+        }
+        float target = scene.dist.lights[light_id].luminance * cosine;
+        float weight = target / source_pdf;
+        if (weight <= 0) {
+            continue;
+        }
+        weight_sum += weight;
+        // Keep the candidate with probability weight / weight_sum and remap
+        // u_reservoir so the next decision gets a fresh uniform number.
+        float p_keep = weight / weight_sum;
+        if (u_reservoir < p_keep) {
+            u_reservoir = std::min(u_reservoir / p_keep, 0x1.fffffep-1f);
+            chosen_light = light_id;
+            chosen_d = d;
+            chosen_target = target;
+        }
+        else {
+            u_reservoir = std::min((u_reservoir - p_keep) / (1 - p_keep), 0x1.fffffep-1f);
+        }
+    }
+    if (chosen_light < 0) {
+        return glm::vec3(0.0);
+    }
+    std::optional<std::pair<int, Intersection>> hit = closest_intersection(Ray(point + norm * eps, chosen_d), scene);
+    if (!hit.has_value() || hit.value().first != scene.dist.lights[chosen_light].obj_id) {
+        return glm::vec3(0.0);
+    }
+    glm::vec3 light_emission = emitted(scene.objects[hit.value().first], hit.value().second);
+    float cosine = glm::dot(norm, chosen_d);
+    float contribution_weight = weight_sum / (candidates * chosen_target);
+    return scene.objects[obj_id].color / 3.14f * light_emission * cosine * contribution_weight;
 }
 
+// Bounce sampling at diffuse vertices: the cosine and light mixture, itself
+// mixed with the learned guiding distribution once guiding is trained.
+glm::vec3 sample_bounce(Scene& scene, glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim) {
+    glm::vec2 u = sampler.get_2d(dim + DIM_BSDF_DIRECTION);
+    float u_light = sampler.get_1d(dim + DIM_BSDF_LOBE);
+    if (!scene.guide.empty()) {
+        const GuidingLeaf& leaf = scene.guide.leaves[scene.guide.leaf_index(point)];
+        float alpha = leaf.selection_probability();
+        if (u.x < alpha) {
+            u.x = std::min(u.x / alpha, 0x1.fffffep-1f);
+            return leaf.sampling.sample(u);
+        }
+        u.x = std::min((u.x - alpha) / (1 - alpha), 0x1.fffffep-1f);
+    }
+    return scene.dist.sample(point, norm, u, u_light);
+}
 
-int convert_color(float component) {
-    component = aces_tone_map(component);
-    component = pow(component, 1.0 / 2.2);
-    return std::round(std::clamp(component * 255, 0.f, 255.f));
+float bounce_pdf(Scene& scene, glm::vec3 point, glm::vec3 norm, glm::vec3 d) {
+    float p = scene.dist.pdf(point, norm, d);
+    if (!scene.guide.empty()) {
+        const GuidingLeaf& leaf = scene.guide.leaves[scene.guide.leaf_index(point)];
+        float alpha = leaf.selection_probability();
+        if (alpha > 0) {
+            p = alpha * leaf.sampling.pdf(d) + (1 - alpha) * p;
+        }
+    }
+    return p;
 }
 
-glm::vec3 get_color(Scene& scene, int obj_id, Ray objR, Intersection inter, int recursion_depth) {
+bool scatter(Scene& scene, int obj_id, Ray& r, Intersection inter, glm::vec3& throughput, Sampler& sampler, int dim, float& bsdf_pdf) {
     const float eps = 1e-4;
-    glm::vec3 start = objR.start + objR.direction * inter.t;
+    glm::vec3 start = r.start + r.direction * inter.t;
+    bsdf_pdf = 0;
     if (scene.objects[obj_id].material == Material::Diffuse) {
         if (inter.is_inside) {
-            return glm::vec3(0.0);
+            return false;
         }
-        glm::vec3 s = scene.dist.sample(start, inter.norm);
+        glm::vec3 s = sample_bounce(scene, start, inter.norm, sampler, dim);
         if (glm::dot(s, inter.norm) <= 0) {
-            return scene.objects[obj_id].emission;
+            return false;
         }
-        Ray r = Ray(start, s);
-        r.start += inter.norm * eps;
-        glm::vec3 color = intersection(r, scene, recursion_depth + 1).second;
         float cosine = glm::dot(inter.norm, s);
-        float p = scene.dist.pdf(start, inter.norm, s);
-        return scene.objects[obj_id].emission + scene.objects[obj_id].color / 3.14f * color * cosine / p;
+        float p = bounce_pdf(scene, start, inter.norm, s);
+        throughput *= scene.objects[obj_id].color / 3.14f * cosine / p;
+        bsdf_pdf = p;
+        r = Ray(start + inter.norm * eps, s);
+        return true;
     }
     if (scene.objects[obj_id].material == Material::Metallic) {
-        Ray r = Ray(start, objR.direction - 2.f * inter.norm * glm::dot(inter.norm, objR.direction));
+        r = Ray(start, r.direction - 2.f * inter.norm * glm::dot(inter.norm, r.direction));
         r.start += r.direction * eps;
-        auto res = intersection(r, scene, recursion_depth + 1);
-        return scene.objects[obj_id].color * res.second + scene.objects[obj_id].emission;
+        throughput *= scene.objects[obj_id].color;
+        return true;
     }
     if (scene.objects[obj_id].material == Material::Dielectric) {
-        float cosine1 = glm::dot(-objR.direction, inter.norm);
+        float cosine1 = glm::dot(-r.direction, inter.norm);
         float n1 = 1;
         float n2 = scene.objects[obj_id].ior;
         if (inter.is_inside) {
@@ -56,66 +181,279 @@ glm::vec3 get_color(Scene& scene, int obj_id, Ray objR, Intersection inter, int
         float R0 = pow((n1 - n2) / (n1 + n2), 2);
         float R = R0 + (1 - R0) * pow(1 - cosine1, 5);
 
-        float ray_choose = scene.generate_random_uniform(0, 1);
+        float ray_choose = sampler.get_1d(dim + DIM_BSDF_LOBE);
 
         if (std::abs(sine2) > 1 || ray_choose < R) {
-            Ray reflected = Ray(start, objR.direction - 2.f * inter.norm * glm::dot(inter.norm, objR.direction));
-            reflected.start += reflected.direction * eps;
-            glm::vec3 reflected_color = intersection(reflected, scene, recursion_depth + 1).second;
-            if (inter.is_inside) {
-                return reflected_color;
-            }
-            return reflected_color + scene.objects[obj_id].emission;
+            r = Ray(start, r.direction - 2.f * inter.norm * glm::dot(inter.norm, r.direction));
+            r.start += r.direction * eps;
+            return true;
         }
         float cosine2 = sqrt(1 - pow(sine2, 2));
-        Ray refracted = Ray(start, n1 / n2 * objR.direction + (n1 / n2 * cosine1 - cosine2) * inter.norm);
-        refracted.start += refracted.direction * eps;
-        glm::vec3 refracted_color = intersection(refracted, scene, recursion_depth + 1).second;
-
-        if (inter.is_inside) {
-            return refracted_color;
+        r = Ray(start, n1 / n2 * r.direction + (n1 / n2 * cosine1 - cosine2) * inter.norm);
+        r.start += r.direction * eps;
+        if (!inter.is_inside) {
+            throughput *= scene.objects[obj_id].color;
         }
-        return refracted_color * scene.objects[obj_id].color + scene.objects[obj_id].emission;
+        return true;
     }
-    return glm::vec3(0.0);
+    return false;
 }
 
-Ray generate_ray(Scene& scene, int x, int y) {
+Ray generate_ray(Scene& scene, int x, int y, Sampler& sampler) {
+    glm::vec2 add = sampler.get_2d(DIM_CAMERA);
+    return generate_ray(scene, glm::vec2(float(x) + add.x, float(y) + add.y));
+}
+
+Ray generate_ray(Scene& scene, glm::vec2 film) {
     float aspect_ratio = scene.width / float(scene.height);
     float tan_fov_x = std::tan(scene.camera_fov_x / 2.0);
     float tan_fov_y = tan_fov_x / aspect_ratio;
-    float add_x = scene.generate_random_uniform(0, 1);
-    float add_y = scene.generate_random_uniform(0, 1);
-    float x_c = float(x) + add_x;
-    float y_c = float(y) + add_y;
+    float x_c = film.x;
+    float y_c = film.y;
     float res_x = (2 * x_c / float(scene.width) - 1) * tan_fov_x;
     float res_y = -(2 * y_c / float(scene.height) - 1) * tan_fov_y;
     glm::vec3 dir = res_x * scene.camera_right + res_y * scene.camera_up + scene.camera_forward;
     return Ray(scene.camera_position, glm::normalize(dir));
 }
 
-std::pair<std::optional<float>, glm::vec3> intersection(Ray r, Scene& s, int recursion_depth) {
-    std::optional<float> inter = std::nullopt;
-    glm::vec3 col = s.bg_color;
-    if (recursion_depth == s.recursion_depth) {
-        return {inter, glm::vec3(0.0)};
-    }
-    int obj_id = -1;
-    std::optional<Intersection> full_inter = std::nullopt;
+std::optional<std::pair<int, Intersection>> closest_intersection(Ray r, Scene& s) {
+    std::optional<std::pair<int, Intersection>> closest = std::nullopt;
     for (int i = 0; i < s.objects.size(); ++i) {
-        std::optional<Intersection> res_int  = intersection(r, s.objects[i]);
-        if (res_int.has_value() && (!inter.has_value() || inter.value() > res_int.value().t)) {
-            inter = res_int.value().t;
-            full_inter = res_int;
-            obj_id = i;
+        std::optional<Intersection> res_int = intersection(r, s.objects[i]);
+        if (res_int.has_value() && (!closest.has_value() || closest.value().second.t > res_int.value().t)) {
+            closest = std::make_pair(i, res_int.value());
         }
     }
-    if (full_inter.has_value()) {
-        col = get_color(s, obj_id, r, full_inter.value(), recursion_depth);
+    return closest;
+}
+
+// Diffuse vertex of a training path, to record the radiance that arrived
+// along the sampled direction once the path is complete.
+struct GuidingVertex {
+    int leaf;
+    glm::vec3 direction;
+    glm::vec3 throughput;
+    glm::vec3 col;
+    float pdf;
+    float guide_pdf;
+    float other_pdf;
+    float cosine;
+};
+
+void record_guiding(Scene& s, const std::vector<GuidingVertex>& vertices, glm::vec3 col) {
+    for (const GuidingVertex& v : vertices) {
+        glm::vec3 incident(0.0);
+        for (int k = 0; k < 3; ++k) {
+            if (v.throughput[k] > 0) {
+                incident[k] = (col[k] - v.col[k]) / v.throughput[k];
+            }
+        }
+        float radiance = 0.2126 * incident.x + 0.7152 * incident.y + 0.0722 * incident.z;
+        GuidingLeaf& leaf = s.guide.leaves[v.leaf];
+        leaf.building.record(v.direction, radiance / v.pdf);
+        leaf.train_selection(radiance * v.cosine, v.guide_pdf, v.other_pdf);
+    }
+}
+
+bool cached_irradiance(Scene& s, glm::vec3 point, glm::vec3 norm, glm::vec3& irradiance);
+
+// In gather mode the path computes indirect light for an irradiance record,
+// so light emitted by the first surface it hits is left out and the cache
+// is not used.
+std::pair<std::optional<float>, glm::vec3> trace_path(Ray r, Scene& s, Sampler& sampler, int recursion_depth, bool gather, FirstHit* first_hit) {
+    std::optional<float> inter = std::nullopt;
+    glm::vec3 col = glm::vec3(0.0);
+    glm::vec3 throughput = glm::vec3(1.0);
+    // Previous diffuse vertex and the pdf of the bounce that left it, for MIS
+    // against next-event estimation. A zero pdf means a specular bounce.
+    glm::vec3 prev_point;
+    glm::vec3 prev_norm;
+    float bsdf_pdf = 0;
+    // Set once a diffuse vertex took its caustics from the photon map, whose
+    // paths through specular surfaces to a light must not count again. A
+    // gathered record is reused at a vertex that takes them from the map.
+    bool caustics_estimated = gather && !s.caustic_map.empty();
+    std::vector<GuidingVertex> guiding_vertices;
+    for (int depth = recursion_depth; depth < s.recursion_depth; ++depth) {
+        std::optional<std::pair<int, Intersection>> hit = closest_intersection(r, s);
+        if (!hit.has_value()) {
+            col += throughput * s.bg_color;
+            break;
+        }
+        auto [obj_id, full_inter] = hit.value();
+        if (depth == recursion_depth) {
+            inter = full_inter.t;
+            if (first_hit) {
+                *first_hit = {obj_id, full_inter.norm, full_inter.t};
+            }
+        }
+        glm::vec3 emission = emitted(s.objects[obj_id], full_inter);
+        int light_id = s.dist.light_index(obj_id);
+        if (emission != glm::vec3(0.0) && bsdf_pdf > 0 && light_id >= 0) {
+            float light_pdf = s.dist.light_pdf(prev_point, prev_norm, r.direction, light_id);
+            if (s.direct_lighting == DirectLighting::Ris) {
+                // Resampling covers every direction the light sampler can produce.
+                emission *= light_pdf > 0 ? 0 : 1;
+            }
+            else {
+                emission *= power_heuristic(bsdf_pdf, light_pdf);
+            }
+        }
+        bool counted_by_photons = caustics_estimated && bsdf_pdf == 0;
+        if ((!gather || depth > recursion_depth) && !counted_by_photons) {
+            col += throughput * emission;
+        }
+
+        int dim = bounce_dimension(depth);
+        glm::vec3 point = r.start + r.direction * full_inter.t;
+        if (s.objects[obj_id].material == Material::Diffuse && !full_inter.is_inside && depth + 1 < s.recursion_depth) {
+            // Secondary diffuse bounces reuse the cached indirect irradiance
+            // and end the path, so direct light takes the full weight.
+            glm::vec3 irradiance;
+            bool cached = s.irradiance_cache && !gather && depth > 0 && bsdf_pdf > 0 && cached_irradiance(s, point, full_inter.norm, irradiance);
+            if (s.direct_lighting == DirectLighting::Ris) {
+                col += throughput * sample_direct_light_ris(s, obj_id, point, full_inter.norm, sampler, dim);
+            }
+            else {
+                col += throughput * sample_direct_light(s, obj_id, point, full_inter.norm, sampler, dim, !cached);
+            }
+            if (!s.caustic_map.empty()) {
+                col += throughput * s.objects[obj_id].color / 3.14f * s.caustic_map.irradiance(point, full_inter.norm, s.caustic_neighbours);
+                caustics_estimated = true;
+            }
+            if (cached) {
+                col += throughput * s.objects[obj_id].color / 3.14f * irradiance;
+                break;
+            }
+        }
+        prev_point = point;
+        prev_norm = full_inter.norm;
+        glm::vec3 col_before = col;
+        if (!scatter(s, obj_id, r, full_inter, throughput, sampler, dim, bsdf_pdf)) {
+            break;
+        }
+        if (s.guide.training && bsdf_pdf > 0) {
+            int leaf = s.guide.leaf_index(point);
+            float guide_pdf = s.guide.leaves[leaf].sampling.pdf(r.direction);
+            float other_pdf = s.dist.pdf(point, full_inter.norm, r.direction);
+            float cosine = glm::dot(full_inter.norm, r.direction);
+            guiding_vertices.push_back({leaf, r.direction, throughput, col_before, bsdf_pdf, guide_pdf, other_pdf, cosine});
+        }
+        if (depth + 1 >= s.roulette_depth) {
+            float q = std::min(std::max(throughput.x, std::max(throughput.y, throughput.z)), 0.95f);
+            if (sampler.get_1d(dim + DIM_ROULETTE) >= q) {
+                break;
+            }
+            throughput /= q;
+        }
+    }
+    if (!guiding_vertices.empty()) {
+        record_guiding(s, guiding_vertices, col);
     }
     return {inter, col};
 }
 
+std::pair<std::optional<float>, glm::vec3> intersection(Ray r, Scene& s, Sampler& sampler, int recursion_depth, FirstHit* first_hit) {
+    return trace_path(r, s, sampler, recursion_depth, false, first_hit);
+}
+
+void trace_caustic_photon(Scene& s, Sampler& sampler, std::vector<Photon>& photons) {
+    const float eps = 1e-4;
+    if (s.dist.lights.empty()) {
+        return;
+    }
+    int dim = bounce_dimension(0);
+    float u_face;
+    int light_id = s.dist.light_table.sample(sampler.get_1d(dim + DIM_LIGHT_SELECT), u_face);
+    LightDistribution& light = s.dist.lights[light_id];
+    glm::vec3 norm;
+    float area_pdf;
+    glm::vec3 point = light.sample_surface(u_face, sampler.get_2d(dim + DIM_LIGHT_POSITION), norm, area_pdf);
+    glm::vec2 u = sampler.get_2d(dim + DIM_BSDF_DIRECTION);
+    Ray r(point + norm * eps, sample_cosine_hemisphere(norm, u.x, u.y));
+    // Cosine-weighted emission cancels the cosine of the emitted power.
+    glm::vec3 power = s.objects[light.obj_id].emission * PI / (area_pdf * s.dist.light_table.pmf[light_id]);
+    bool specular = false;
+    for (int depth = 1; depth < s.recursion_depth; ++depth) {
+        std::optional<std::pair<int, Intersection>> hit = closest_intersection(r, s);
+        if (!hit.has_value()) {
+            return;
+        }
+        auto [obj_id, inter] = hit.value();
+        if (s.objects[obj_id].material == Material::Diffuse) {
+            if (specular && !inter.is_inside) {
+                photons.push_back({r.start + r.direction * inter.t, r.direction, power, 0});
+            }
+            return;
+        }
+        specular = true;
+        float bsdf_pdf;
+        if (!scatter(s, obj_id, r, inter, power, sampler, bounce_dimension(depth), bsdf_pdf)) {
+            return;
+        }
+    }
+}
+
+// Interpolates the indirect irradiance at a vertex from the cache, gathering
+// a new record if none is close enough. Fails only once the cache is full.
+// Records are gathered as if at the first bounce, so every record covers the
+// same number of bounces wherever it is reused.
+bool cached_irradiance(Scene& s, glm::vec3 point, glm::vec3 norm, glm::vec3& irradiance) {
+    const float eps = 1e-4;
+    IrradianceCache& cache = *s.irradiance_cache;
+    if (cache.lookup(point, norm, irradiance)) {
+        return true;
+    }
+    if (cache.full()) {
+        return false;
+    }
+    const int strata = IRRADIANCE_THETA_STRATA * IRRADIANCE_PHI_STRATA;
+    std::vector<glm::vec3> radiance(strata);
+    std::vector<glm::vec3> directions(strata);
+    std::vector<float> distance(strata);
+    uint32_t seed = hash_combine(hash_combine(hash_uint(std::bit_cast<uint32_t>(point.x)), std::bit_cast<uint32_t>(point.y)), std::bit_cast<uint32_t>(point.z));
+    IndependentSampler sampler(seed);
+    int dim = bounce_dimension(1);
+    for (int j = 0; j < IRRADIANCE_THETA_STRATA; ++j) {
+        for (int k = 0; k < IRRADIANCE_PHI_STRATA; ++k) {
+            int index = j * IRRADIANCE_PHI_STRATA + k;
+            sampler.start_pixel_sample(j, k, 0);
+            directions[index] = irradiance_stratum_direction(norm, j, k, sampler.get_2d(dim + DIM_BSDF_DIRECTION));
+            auto [hit, l] = trace_path(Ray(point + norm * eps, directions[index]), s, sampler, 2, true, nullptr);
+            for (int c = 0; c < 3; ++c) {
+                if (std::isnan(l[c])) {
+                    l[c] = 0;
+                }
+            }
+            radiance[index] = l;
+            distance[index] = hit.has_value() ? std::max(hit.value(), eps) : INFINITY;
+        }
+    }
+    IrradianceRecord record = cache.make_record(point, norm, radiance, directions, distance);
+    cache.insert(record);
+    irradiance = record.irradiance;
+    return true;
+}
+
+void scene_bounds(Scene& s, glm::vec3& min, glm::vec3& max) {
+    min = s.camera_position;
+    max = s.camera_position;
+    for (const Object& obj : s.objects) {
+        glm::vec3 half_size(0.0);
+        if (const Box* bval = std::get_if<Box>(&obj.shape)) {
+            half_size = glm::vec3(glm::length(bval->size));
+        }
+        if (const Ellips* eval = std::get_if<Ellips>(&obj.shape)) {
+            half_size = glm::vec3(std::max(eval->radius.x, std::max(eval->radius.y, eval->radius.z)));
+        }
+        min = glm::min(min, obj.position - half_size);
+        max = glm::max(max, obj.position + half_size);
+    }
+    glm::vec3 margin = (max - min) * 0.01f + 1e-3f;
+    min -= margin;
+    max += margin;
+}
+
 std::optional<Intersection> intersection(Ray r, Object obj) {
     r.start -= obj.position;
     glm::quat back_rotation = glm::inverse(obj.rotation);
@@ -0,0 +1,194 @@
+#include "sampler.h"
+#include "blue_noise_tables.h"
+#include <algorithm>
+
+uint32_t reverse_bits(uint32_t x) {
+    x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+    x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+    x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+    x += seed;
+    x ^= x * 0x6c50b47cU;
+    x ^= x * 0xb82f1e52U;
+    x ^= x * 0xc7afe638U;
+    x ^= x * 0x8d22f6e6U;
+    return x;
+}
+
+uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits(x);
+    x = laine_karras_permutation(x, seed);
+    return reverse_bits(x);
+}
+
+// The first two Sobol dimensions: van der Corput and the Pascal matrix.
+uint32_t sobol_0(uint32_t index) {
+    return reverse_bits(index);
+}
+
+uint32_t sobol_1(uint32_t index) {
+    uint32_t result = 0;
+    uint32_t v = 0x80000000U;
+    for (; index != 0; index >>= 1) {
+        if (index & 1) {
+            result ^= v;
+        }
+        v ^= v >> 1;
+    }
+    return result;
+}
+
+float to_unit_float(uint32_t x) {
+    return std::min(float(x >> 8) * 0x1p-24f, 0x1.fffffep-1f);
+}
+
+void IndependentSampler::start_pixel_sample(int x, int y, int sample_index) {
+    uint32_t pixel = hash_combine(hash_combine(seed, x), y);
+    g = Pcg32(hash_combine(pixel, sample_index), pixel);
+}
+
+float IndependentSampler::get_1d(int dim) {
+    return g.next_float();
+}
+
+glm::vec2 IndependentSampler::get_2d(int dim) {
+    float u1 = g.next_float();
+    float u2 = g.next_float();
+    return glm::vec2(u1, u2);
+}
+
+void SobolSampler::start_pixel_sample(int x, int y, int sample_index) {
+    pixel_seed = hash_combine(hash_combine(seed, x), y);
+    index = sample_index;
+}
+
+float SobolSampler::get_1d(int dim) {
+    uint32_t dim_seed = hash_combine(pixel_seed, dim);
+    uint32_t shuffled = nested_uniform_scramble(index, dim_seed);
+    return to_unit_float(nested_uniform_scramble(sobol_0(shuffled), hash_uint(dim_seed + 1)));
+}
+
+glm::vec2 SobolSampler::get_2d(int dim) {
+    uint32_t dim_seed = hash_combine(pixel_seed, dim);
+    uint32_t shuffled = nested_uniform_scramble(index, dim_seed);
+    float u1 = to_unit_float(nested_uniform_scramble(sobol_0(shuffled), hash_uint(dim_seed + 1)));
+    float u2 = to_unit_float(nested_uniform_scramble(sobol_1(shuffled), hash_uint(dim_seed + 2)));
+    return glm::vec2(u1, u2);
+}
+
+BlueNoiseSampler::BlueNoiseSampler(uint32_t seed, int samples) : Sampler(seed) {
+    stratum_bits = 0;
+    while (stratum_bits < 16 && (1 << stratum_bits) < samples) {
+        ++stratum_bits;
+    }
+}
+
+void BlueNoiseSampler::start_pixel_sample(int x, int y, int sample_index) {
+    int tile_x = x / BLUE_NOISE_SIZE;
+    int tile_y = y / BLUE_NOISE_SIZE;
+    tile_seed = hash_combine(hash_combine(seed, tile_x), tile_y);
+    int layer = tile_seed % BLUE_NOISE_LAYERS;
+    uint32_t rank = BLUE_NOISE_RANKS[layer][x % BLUE_NOISE_SIZE + (y % BLUE_NOISE_SIZE) * BLUE_NOISE_SIZE];
+    index = (rank << stratum_bits) + sample_index;
+}
+
+float BlueNoiseSampler::get_1d(int dim) {
+    uint32_t dim_seed = hash_combine(tile_seed, dim);
+    uint32_t shuffled = nested_uniform_scramble(index, dim_seed);
+    return to_unit_float(nested_uniform_scramble(sobol_0(shuffled), hash_uint(dim_seed + 1)));
+}
+
+glm::vec2 BlueNoiseSampler::get_2d(int dim) {
+    uint32_t dim_seed = hash_combine(tile_seed, dim);
+    uint32_t shuffled = nested_uniform_scramble(index, dim_seed);
+    float u1 = to_unit_float(nested_uniform_scramble(sobol_0(shuffled), hash_uint(dim_seed + 1)));
+    float u2 = to_unit_float(nested_uniform_scramble(sobol_1(shuffled), hash_uint(dim_seed + 2)));
+    return glm::vec2(u1, u2);
+}
+
+void PssSampler::start_pixel_sample(int x, int y, int sample_index) {
+    uint32_t stream = hash_combine(hash_combine(seed, x), y);
+    g = Pcg32(hash_combine(stream, sample_index), stream);
+    values.clear();
+    iteration = 0;
+    last_large_step = 0;
+    large_step = true;
+}
+
+float PssSampler::get_1d(int dim) {
+    mutate(dim);
+    return values[dim].value;
+}
+
+glm::vec2 PssSampler::get_2d(int dim) {
+    mutate(dim);
+    mutate(dim + 1);
+    return glm::vec2(values[dim].value, values[dim + 1].value);
+}
+
+void PssSampler::start_iteration() {
+    iteration += 1;
+    large_step = g.next_float() < large_step_probability;
+}
+
+void PssSampler::accept() {
+    if (large_step) {
+        last_large_step = iteration;
+    }
+}
+
+void PssSampler::reject() {
+    for (PrimarySample& x : values) {
+        if (x.modified == iteration) {
+            x.value = x.backup;
+            x.modified = x.modified_backup;
+        }
+    }
+    iteration -= 1;
+}
+
+void PssSampler::mutate(int dim) {
+    if (dim >= values.size()) {
+        values.resize(dim + 1);
+    }
+    PrimarySample& x = values[dim];
+    if (x.modified == iteration) {
+        return;
+    }
+    // Dimensions not read since the last accepted large step still hold a
+    // value from before it, which the large step would have replaced.
+    if (x.modified < last_large_step) {
+        x.value = g.next_float();
+        x.modified = last_large_step;
+    }
+    x.backup = x.value;
+    x.modified_backup = x.modified;
+    if (large_step) {
+        x.value = g.next_float();
+    }
+    else {
+        // The small steps missed since the last read add up to one normal
+        // offset with a proportionally larger variance.
+        float u1 = 1 - g.next_float();
+        float u2 = g.next_float();
+        float normal = std::sqrt(-2 * std::log(u1)) * std::cos(2 * PI * u2);
+        x.value += normal * sigma * std::sqrt(float(iteration - x.modified));
+        x.value -= std::floor(x.value);
+        x.value = std::min(x.value, 0x1.fffffep-1f);
+    }
+    x.modified = iteration;
+}
+
+std::unique_ptr<Sampler> make_sampler(SamplerType type, uint32_t seed, int samples) {
+    if (type == SamplerType::Sobol) {
+        return std::make_unique<SobolSampler>(seed);
+    }
+    if (type == SamplerType::BlueNoise) {
+        return std::make_unique<BlueNoiseSampler>(seed, samples);
+    }
+    return std::make_unique<IndependentSampler>(seed);
+}
@@ -0,0 +1,132 @@
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <glm/vec2.hpp>
+#include "random.h"
+
+#pragma once
+
+enum class SamplerType {Independent, Sobol, BlueNoise};
+
+// Every decision along a path reads a fixed dimension, so the same
+// dimension of a low-discrepancy sequence always drives the same integral.
+const int DIM_CAMERA = 0;
+const int DIM_BOUNCE_BASE = 2;
+
+const int DIM_LIGHT_SELECT = 0;
+const int DIM_LIGHT_POSITION = 1;
+const int DIM_BSDF_LOBE = 3;
+const int DIM_BSDF_DIRECTION = 4;
+const int DIM_ROULETTE = 6;
+const int DIM_LIGHT_RESERVOIR = 7;
+const int DIMS_PER_BOUNCE = 8;
+
+inline int bounce_dimension(int depth) {
+    return DIM_BOUNCE_BASE + depth * DIMS_PER_BOUNCE;
+}
+
+inline uint32_t hash_uint(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t hash_combine(uint32_t seed, uint32_t v) {
+    return seed ^ (hash_uint(v) + 0x9e3779b9U + (seed << 6) + (seed >> 2));
+}
+
+struct Sampler {
+    uint32_t seed;
+
+    Sampler(uint32_t seed) : seed(seed) {}
+    virtual ~Sampler() = default;
+
+    virtual void start_pixel_sample(int x, int y, int sample_index) = 0;
+    virtual float get_1d(int dim) = 0;
+    virtual glm::vec2 get_2d(int dim) = 0;
+};
+
+struct IndependentSampler : public Sampler {
+    Pcg32 g;
+
+    IndependentSampler(uint32_t seed) : Sampler(seed) {}
+
+    void start_pixel_sample(int x, int y, int sample_index) override;
+    float get_1d(int dim) override;
+    glm::vec2 get_2d(int dim) override;
+};
+
+// Owen-scrambled Sobol points with hash-based shuffling of the sample index
+// per dimension pair (Burley 2020, "Practical Hash-based Owen Scrambling").
+struct SobolSampler : public Sampler {
+    uint32_t pixel_seed;
+    uint32_t index;
+
+    SobolSampler(uint32_t seed) : Sampler(seed) {}
+
+    void start_pixel_sample(int x, int y, int sample_index) override;
+    float get_1d(int dim) override;
+    glm::vec2 get_2d(int dim) override;
+};
+
+// Screen-space blue-noise sampler for low sample counts. A pixel takes a
+// contiguous chunk of one Owen-scrambled Sobol sequence per tile, at the
+// position given by its rank in a precomputed hierarchical rank table
+// (see blue_noise_tool.cpp). Every aligned block of neighbouring pixels
+// then owns an aligned block of the sequence, which is itself well
+// stratified, so the errors of neighbours cancel and the per-pixel error
+// is distributed as blue noise.
+struct BlueNoiseSampler : public Sampler {
+    uint32_t tile_seed;
+    uint32_t index;
+    int stratum_bits;
+
+    BlueNoiseSampler(uint32_t seed, int samples);
+
+    void start_pixel_sample(int x, int y, int sample_index) override;
+    float get_1d(int dim) override;
+    glm::vec2 get_2d(int dim) override;
+};
+
+// Primary sample space of Metropolis light transport (Kelemen et al. 2002,
+// "A Simple and Robust Mutation Strategy for the Metropolis Light Transport
+// Algorithm"). Every dimension keeps its value between iterations and is
+// mutated lazily when it is read: a large step draws it anew, a small step
+// perturbs it by a normal offset wrapped into [0, 1). start_pixel_sample()
+// restarts from the independent sample of that index, so a state found
+// while bootstrapping can be replayed from its index alone.
+struct PrimarySample {
+    float value = 0;
+    float backup = 0;
+    // Iteration of the last change, -1 if the dimension was never read.
+    int64_t modified = -1;
+    int64_t modified_backup = -1;
+};
+
+struct PssSampler : public Sampler {
+    Pcg32 g;
+    float sigma;
+    float large_step_probability;
+    std::vector<PrimarySample> values;
+    int64_t iteration = 0;
+    int64_t last_large_step = 0;
+    bool large_step = true;
+
+    PssSampler(uint32_t seed, float sigma, float large_step_probability) : Sampler(seed), sigma(sigma), large_step_probability(large_step_probability) {}
+
+    void start_pixel_sample(int x, int y, int sample_index) override;
+    float get_1d(int dim) override;
+    glm::vec2 get_2d(int dim) override;
+    // Starts a mutation, which is then kept by accept() or undone by reject().
+    void start_iteration();
+    void accept();
+    void reject();
+
+    private:
+    void mutate(int dim);
+};
+
+std::unique_ptr<Sampler> make_sampler(SamplerType type, uint32_t seed, int samples);
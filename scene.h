@@ -1,13 +1,38 @@
 #include <vector>
 #include <variant>
 #include <random>
+#include <memory>
 #include <glm/vec3.hpp>
 #include "structures.h"
 #include "distribution.h"
 #include "ray.h"
+#include "sampler.h"
+#include "guiding.h"
+#include "irradiance_cache.h"
+#include "photon_map.h"
+#include "image_writer.h"
 
 #pragma once
 
+// How direct light is estimated at diffuse vertices: one light sample per
+// vertex, or resampled importance sampling that picks one of several
+// candidates by unshadowed contribution before tracing the shadow ray.
+enum class DirectLighting {Nee, Ris};
+
+// Unidirectional path tracing, bidirectional path tracing, or primary sample
+// space Metropolis light transport over the paths of the path tracer. Only
+// path tracing uses the guiding, the irradiance cache and the caustic photon
+// map.
+enum class Integrator {Path, Bdpt, Mlt};
+
+// First surface hit by a camera ray, for the guides of the framebuffer.
+struct FirstHit {
+    int obj_id = -1;
+    // Faces the camera.
+    glm::vec3 norm = glm::vec3(0.0);
+    float depth = 0;
+};
+
 struct Scene {
     int width;
     int height;
@@ -18,24 +43,67 @@ struct Scene {
     glm::vec3 camera_forward;
     float camera_fov_x;
     int recursion_depth;
+    int roulette_depth = 3;
     int samples;
+    Integrator integrator = Integrator::Path;
+    // Independent paths estimating the image brightness and seeding the
+    // Metropolis chains, and the probability of a large step mutation.
+    int mlt_bootstrap = 100000;
+    float mlt_large_step = 0.3;
+    // A-trous passes of the denoiser, 0 disables it.
+    int denoise_iterations = 0;
+    // Write the first-hit buffers of the framebuffer next to the image.
+    bool write_aovs = false;
+    ImageOptions image_options;
+    // Render straight into a memory-mapped output file, flushing it every
+    // sync_rows rows if that is positive.
+    bool mapped_output = false;
+    int sync_rows = 0;
+    // Render in tiles of this size spilled to disk, 0 renders into memory,
+    // with at most tile_memory_mb of tiles in memory at once.
+    int tile_size = 0;
+    int tile_memory_mb = 256;
+    // Keep the color, albedo and normal of the framebuffer as halves.
+    bool half_framebuffer = false;
+    SamplerType sampler_type = SamplerType::Independent;
+    DirectLighting direct_lighting = DirectLighting::Nee;
+    int ris_candidates = 8;
+    // Number of path guiding training passes, 0 disables guiding.
+    int guiding_passes = 0;
+    // Error bound of the irradiance cache, 0 disables it.
+    float irradiance_error = 0;
+    int irradiance_memory_mb = 256;
+    // Number of caustic photons to store, 0 disables the photon map.
+    int caustic_photons = 0;
+    int caustic_neighbours = 50;
 
     std::vector<Object> objects;
 
     MixDistribution dist;
-    std::minstd_rand g = std::minstd_rand(239);
+    GuidingField guide;
+    std::unique_ptr<IrradianceCache> irradiance_cache;
+    PhotonMap caustic_map;
 
     Scene() = default;
-
-    float generate_random_uniform(float a, float b) {
-        std::uniform_real_distribution<> dist(a, b);
-        return dist(g);
-    }
 };
 
 
-Ray generate_ray(Scene& scene, int x, int y);
-std::pair<std::optional<float>, glm::vec3> intersection(Ray r, Scene& s, int recursion_depth);
-int convert_color(float component);
+Ray generate_ray(Scene& scene, int x, int y, Sampler& sampler);
+// Ray through a point of the image plane given in pixels.
+Ray generate_ray(Scene& scene, glm::vec2 film);
+std::pair<std::optional<float>, glm::vec3> intersection(Ray r, Scene& s, Sampler& sampler, int recursion_depth, FirstHit* first_hit = nullptr);
 
-glm::vec3 get_color(Scene& scene, int obj_id, Ray objR, Intersection inter, int recursion_depth);
\ No newline at end of file
+std::optional<std::pair<int, Intersection>> closest_intersection(Ray r, Scene& s);
+glm::vec3 emitted(const Object& obj, Intersection inter);
+float power_heuristic(float pdf_a, float pdf_b);
+// Without mis the light sample gets the full weight, for vertices whose
+// bounce is not traced.
+glm::vec3 sample_direct_light(Scene& scene, int obj_id, glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim, bool mis);
+glm::vec3 sample_direct_light_ris(Scene& scene, int obj_id, glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim);
+glm::vec3 sample_bounce(Scene& scene, glm::vec3 point, glm::vec3 norm, Sampler& sampler, int dim);
+float bounce_pdf(Scene& scene, glm::vec3 point, glm::vec3 norm, glm::vec3 d);
+bool scatter(Scene& scene, int obj_id, Ray& r, Intersection inter, glm::vec3& throughput, Sampler& sampler, int dim, float& bsdf_pdf);
+void scene_bounds(Scene& s, glm::vec3& min, glm::vec3& max);
+// Emits one photon and appends it to photons if it reaches a diffuse surface
+// through specular or dielectric objects.
+void trace_caustic_photon(Scene& s, Sampler& sampler, std::vector<Photon>& photons);
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <glm/vec3.hpp>
 #include <glm/vec4.hpp>
 #include <glm/gtx/quaternion.hpp>
+#include "half.h"
 
 #pragma once
 
@@ -60,6 +61,44 @@ struct Box {
     }
 };
 
+// Linear image of a render with the guides of the first surfaces the camera
+// rays hit, every value averaged over the samples of the pixel. Pixels whose
+// rays missed the scene have zero albedo, normal and depth. The color,
+// albedo and normal may be kept in half precision; they are written once per
+// pixel, the sums over its samples being float.
+struct Framebuffer {
+    int width;
+    int height;
+    Vec3Buffer color;
+    // Variance of the mean of the luminance divided by the albedo, empty if
+    // it could not be estimated per pixel.
+    std::vector<float> variance;
+    Vec3Buffer albedo;
+    Vec3Buffer normal;
+    std::vector<float> depth;
+    // Object hit by the first sample of the pixel that hit one, -1 if none.
+    std::vector<int> object;
+    // Camera samples that landed in the pixel.
+    std::vector<int> samples;
+
+    Framebuffer() = default;
+    Framebuffer(int w, int h, bool half_precision = false) {
+        width = w;
+        height = h;
+        color = Vec3Buffer(w * h, half_precision);
+        albedo = Vec3Buffer(w * h, half_precision);
+        normal = Vec3Buffer(w * h, half_precision);
+        depth.assign(w * h, 0);
+        object.assign(w * h, -1);
+        samples.assign(w * h, 0);
+    }
+
+    // Bytes held by the buffers.
+    size_t memory() const {
+        return color.memory() + albedo.memory() + normal.memory() + (variance.size() + depth.size()) * sizeof(float) + (object.size() + samples.size()) * sizeof(int);
+    }
+};
+
 using Shape = std::variant<Plane, Ellips, Box>;
 
 enum class Material {Diffuse, Metallic, Dielectric};
@@ -0,0 +1,88 @@
+#include "tiled_framebuffer.h"
+#include <algorithm>
+#include <vector>
+#include <cstdio>
+#include <fcntl.h>
+#include <unistd.h>
+
+TileGrid::TileGrid(int width, int height, int tile_size) {
+    this->width = width;
+    this->height = height;
+    this->tile_size = tile_size;
+    tiles_x = (width + tile_size - 1) / tile_size;
+    tiles_y = (height + tile_size - 1) / tile_size;
+}
+
+void TileGrid::tile_bounds(int tile, int& x0, int& y0, int& x1, int& y1) const {
+    x0 = tile % tiles_x * tile_size;
+    y0 = tile / tiles_x * tile_size;
+    x1 = std::min(width, x0 + tile_size);
+    y1 = std::min(height, y0 + tile_size);
+}
+
+TiledFramebuffer::TiledFramebuffer(std::string filename, int width, int height, int tile_size) : TileGrid(width, height, tile_size) {
+    this->filename = filename;
+    fd = open(filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+}
+
+TiledFramebuffer::~TiledFramebuffer() {
+    if (fd >= 0) {
+        close(fd);
+        std::remove(filename.c_str());
+    }
+}
+
+bool TiledFramebuffer::valid() const {
+    return fd >= 0;
+}
+
+// Writes or reads all of size bytes, which pwrite and pread may split.
+template <typename Transfer, typename Pointer>
+bool transfer_all(Transfer transfer, int fd, Pointer data, size_t size, off_t offset) {
+    while (size > 0) {
+        ssize_t done = transfer(fd, data, size, offset);
+        if (done <= 0) {
+            return false;
+        }
+        data += done;
+        size -= done;
+        offset += done;
+    }
+    return true;
+}
+
+bool TiledFramebuffer::write_tile(int tile, const Framebuffer& frame) {
+    size_t slot = size_t(tile_size) * tile_size * sizeof(glm::vec3);
+    std::vector<glm::vec3> colors;
+    const char* data = reinterpret_cast<const char*>(frame.color.float_data(colors));
+    return transfer_all(pwrite, fd, data, frame.color.size() * sizeof(glm::vec3), off_t(tile * slot));
+}
+
+bool TiledFramebuffer::assemble(bool bottom_up, const std::function<void(int, const glm::vec3*)>& row) const {
+    size_t slot = size_t(tile_size) * tile_size * sizeof(glm::vec3);
+    // One row of tiles at a time, each tile read with a single call.
+    std::vector<glm::vec3> strip(size_t(width) * tile_size);
+    std::vector<glm::vec3> tile(size_t(tile_size) * tile_size);
+    for (int k = 0; k < tiles_y; ++k) {
+        int ty = bottom_up ? tiles_y - 1 - k : k;
+        // The tiles of a strip share its y0 and y1.
+        int x0, y0, x1, y1;
+        tile_bounds(ty * tiles_x, x0, y0, x1, y1);
+        for (int tx = 0; tx < tiles_x; ++tx) {
+            tile_bounds(ty * tiles_x + tx, x0, y0, x1, y1);
+            int tile_width = x1 - x0;
+            char* data = reinterpret_cast<char*>(tile.data());
+            if (!transfer_all(pread, fd, data, size_t(tile_width) * (y1 - y0) * sizeof(glm::vec3), off_t((ty * tiles_x + tx) * slot))) {
+                return false;
+            }
+            for (int y = y0; y < y1; ++y) {
+                std::copy_n(&tile[size_t(y - y0) * tile_width], tile_width, &strip[size_t(y - y0) * width + x0]);
+            }
+        }
+        for (int i = 0; i < y1 - y0; ++i) {
+            int y = bottom_up ? y1 - 1 - i : y0 + i;
+            row(y, &strip[size_t(y - y0) * width]);
+        }
+    }
+    return true;
+}
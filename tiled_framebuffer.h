@@ -0,0 +1,42 @@
+#include <string>
+#include <functional>
+#include <glm/vec3.hpp>
+#include "structures.h"
+
+#pragma once
+
+// Square tiles covering an image, numbered in row-major order.
+struct TileGrid {
+    int width;
+    int height;
+    int tile_size;
+    int tiles_x;
+    int tiles_y;
+
+    TileGrid(int width, int height, int tile_size);
+    // Image rectangle of a tile.
+    void tile_bounds(int tile, int& x0, int& y0, int& x1, int& y1) const;
+};
+
+// Colors of an image too large for memory, rendered as square tiles that
+// are written to a spill file as soon as they are finished. The file holds
+// one fixed-size slot of linear colors per tile, tiles in row-major order
+// and pixels in row-major order within a tile, so every tile has its place
+// in the file however the tiles are handed out. The image is assembled from
+// the slots one row of tiles at a time.
+struct TiledFramebuffer : TileGrid {
+    TiledFramebuffer(std::string filename, int width, int height, int tile_size);
+    ~TiledFramebuffer();
+    // False if the spill file could not be created.
+    bool valid() const;
+    // Stores the colors of a rendered tile. Safe to call from several
+    // threads.
+    bool write_tile(int tile, const Framebuffer& frame);
+    // Calls row with every scanline of the image, bottom to top if
+    // bottom_up, else top to bottom.
+    bool assemble(bool bottom_up, const std::function<void(int, const glm::vec3*)>& row) const;
+
+private:
+    std::string filename;
+    int fd = -1;
+};
@@ -0,0 +1,91 @@
+#include "tone_map.h"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+// Entries of the gamma table, over the square root of the tone mapped value.
+// Near black one entry spans a tenth of an output step.
+const int TONE_MAP_TABLE_SIZE = 4096;
+const float TONE_MAP_MAX_INPUT = 1e4;
+// Components converted per pass of the curve loop.
+const int TONE_MAP_BLOCK = 1024;
+
+static_assert(sizeof(Color) == 3, "rows of colors are written as bytes");
+
+float aces_tone_map(float component) {
+    const float a = 2.51f;
+    const float b = 0.03f;
+    const float c = 2.43f;
+    const float d = 0.59f;
+    const float e = 0.14f;
+    float color = (component * (a * component + b)) / (component * (c * component + d) + e);
+    return glm::clamp(color, 0.f, 1.f);
+}
+
+int convert_color(float component) {
+    component = aces_tone_map(component);
+    component = pow(component, 1.0 / 2.2);
+    return std::round(std::clamp(component * 255, 0.f, 255.f));
+}
+
+std::array<unsigned char, TONE_MAP_TABLE_SIZE> gamma_table() {
+    std::array<unsigned char, TONE_MAP_TABLE_SIZE> table;
+    for (int i = 0; i < TONE_MAP_TABLE_SIZE; ++i) {
+        double root = double(i) / (TONE_MAP_TABLE_SIZE - 1);
+        table[i] = std::round(std::clamp(pow(root * root, 1.0 / 2.2) * 255, 0.0, 255.0));
+    }
+    return table;
+}
+
+const std::array<unsigned char, TONE_MAP_TABLE_SIZE> GAMMA_TABLE = gamma_table();
+
+// Table positions of count components. Beyond TONE_MAP_MAX_INPUT the curve
+// is clamped to 1 either way, and limiting the input keeps its products
+// from overflowing into NaN.
+void tone_map_indices(const float* __restrict components, int count, int* __restrict indices) {
+    const float a = 2.51f;
+    const float b = 0.03f;
+    const float c = 2.43f;
+    const float d = 0.59f;
+    const float e = 0.14f;
+    for (int i = 0; i < count; ++i) {
+        float x = std::clamp(components[i], -TONE_MAP_MAX_INPUT, TONE_MAP_MAX_INPUT);
+        float color = (x * (a * x + b)) / (x * (c * x + d) + e);
+        color = std::min(1.f, std::max(0.f, color));
+        indices[i] = int(std::sqrt(color) * (TONE_MAP_TABLE_SIZE - 1) + 0.5f);
+    }
+}
+
+void tone_map_row(const glm::vec3* colors, Color* out, int width) {
+    const float* components = reinterpret_cast<const float*>(colors);
+    unsigned char* bytes = reinterpret_cast<unsigned char*>(out);
+    int indices[TONE_MAP_BLOCK];
+    for (int begin = 0; begin < width * 3; begin += TONE_MAP_BLOCK) {
+        int count = std::min(TONE_MAP_BLOCK, width * 3 - begin);
+        tone_map_indices(components + begin, count, indices);
+        for (int i = 0; i < count; ++i) {
+            bytes[begin + i] = GAMMA_TABLE[indices[i]];
+        }
+    }
+}
+
+void tone_map(const Vec3Buffer& colors, Color* out, int width, int height, int threads) {
+    std::atomic<int> next_row = 0;
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&]() {
+            std::vector<glm::vec3> row(width);
+            for (int y = next_row++; y < height; y = next_row++) {
+                size_t offset = size_t(y) * width;
+                colors.read(offset, width, row.data());
+                tone_map_row(row.data(), out + offset, width);
+            }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+}
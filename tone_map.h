@@ -0,0 +1,16 @@
+#include "structures.h"
+
+#pragma once
+
+// Conversion of the linear render to 8-bit colors: the ACES filmic curve
+// (Narkowicz 2015, "ACES Filmic Tone Mapping Curve"), a 2.2 gamma and
+// rounding. convert_color is the scalar reference, which raytracing_bench
+// checks tone_map_row against.
+int convert_color(float component);
+// Converts a row of width pixels, within one step of convert_color. The
+// curve runs over the row's components as one loop of vector code; the
+// gamma is read from a table indexed by the square root of the tone mapped
+// value, on which it is close to linear even near black.
+void tone_map_row(const glm::vec3* colors, Color* out, int width);
+// Converts width * height pixels, rows on several threads.
+void tone_map(const Vec3Buffer& colors, Color* out, int width, int height, int threads);